@@ -2,12 +2,139 @@
 #define SEQUENCES_H
 
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <typeinfo>
+#include <chrono>
 #include <functional>
-
-const int AdaptiveSequenceSwitch = 200;
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <climits>
+#include <cstdio>
+#include <limits>
+#include <locale>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 using namespace std;
 
+inline int GetL1DataCacheSize() {
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    long size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    if (size > 0) {
+        return static_cast<int>(size);
+    }
+#endif
+    return 32 * 1024;
+}
+
+inline int GetCacheLineSize() {
+#ifdef _SC_LEVEL1_DCACHE_LINESIZE
+    long size = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+    if (size > 0) {
+        return static_cast<int>(size);
+    }
+#endif
+    return 64;
+}
+
+// Per-type thresholds. The defaults follow the cache geometry and
+// sizeof(T); CalibrateSequenceTuning<T>() measures them on this machine
+// and Load/Save keep the result in a small text file between runs.
+template <class T>
+class SequenceTuning {
+private:
+    static int& AdaptiveSwitch() {
+        static int value = max(16, GetL1DataCacheSize() / 16 / static_cast<int>(sizeof(T)));
+        return value;
+    }
+
+    static int& SegmentSize() {
+        static int value = max(16, 4 * GetCacheLineSize() / static_cast<int>(sizeof(T)));
+        return value;
+    }
+
+    static string Key() {
+        ostringstream key;
+        key << typeid(T).name() << ':' << sizeof(T);
+        return key.str();
+    }
+
+public:
+    // Below this size AdaptiveSequence always stays an array.
+    static int GetAdaptiveSwitch() {
+        return AdaptiveSwitch();
+    }
+
+    static void SetAdaptiveSwitch(int value) {
+        AdaptiveSwitch() = max(1, value);
+    }
+
+    // Elements per segment of a newly created SegmentedList.
+    static int GetSegmentSize() {
+        return SegmentSize();
+    }
+
+    static void SetSegmentSize(int value) {
+        SegmentSize() = max(2, value);
+    }
+
+    // One "key adaptiveSwitch segmentSize" line per type.
+    static bool Load(const char* path) {
+        ifstream file(path);
+        string line;
+        while (getline(file, line)) {
+            istringstream fields(line);
+            string key;
+            int adaptiveSwitch, segmentSize;
+            if (fields >> key >> adaptiveSwitch >> segmentSize && key == Key()) {
+                SetAdaptiveSwitch(adaptiveSwitch);
+                SetSegmentSize(segmentSize);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool Save(const char* path) {
+        string contents;
+        {
+            ifstream file(path);
+            string line;
+            while (getline(file, line)) {
+                istringstream fields(line);
+                string key;
+                if (fields >> key && key != Key()) {
+                    contents += line + "\n";
+                }
+            }
+        }
+        ofstream file(path, ios::trunc);
+        file << contents << Key() << ' ' << GetAdaptiveSwitch() << ' ' << GetSegmentSize() << "\n";
+        return static_cast<bool>(file);
+    }
+};
+
 class IndexOutOfRange : public exception {
 public:
     const char* what() const noexcept override {
@@ -15,6 +142,53 @@ public:
     }
 };
 
+class SequenceFileError : public exception {
+private:
+    const char* message;
+
+public:
+    explicit SequenceFileError(const char* message) : message(message) {}
+
+    const char* what() const noexcept override {
+        return message;
+    }
+};
+
+class UnsupportedOperation : public exception {
+private:
+    const char* message;
+
+public:
+    explicit UnsupportedOperation(const char* message) : message(message) {}
+
+    const char* what() const noexcept override {
+        return message;
+    }
+};
+
+struct AlwaysCheckBounds {
+    static constexpr bool Enabled = true;
+};
+
+struct DebugCheckBounds {
+#ifdef NDEBUG
+    static constexpr bool Enabled = false;
+#else
+    static constexpr bool Enabled = true;
+#endif
+};
+
+struct NeverCheckBounds {
+    static constexpr bool Enabled = false;
+};
+
+template <class Checking>
+inline void CheckIndex(int index, int size) {
+    if (Checking::Enabled && (index < 0 || index >= size)) {
+        throw IndexOutOfRange();
+    }
+}
+
 template <class T>
 class ICollection {
 public:
@@ -55,53 +229,159 @@ public:
     }
 };
 
-template <class T>
+template <class T, class Checking = AlwaysCheckBounds>
 class DynamicArray{
 private:
+    // Copies share one buffer; it is duplicated on the first write.
+    shared_ptr<T> buffer;
     T* data;
     int size;
+    int capacity;
+    // Second reference Publish keeps, so the first write afterwards takes
+    // the shared path of Detach.
+    mutable shared_ptr<T> pin;
+    // Set once operator[] or At has handed out a writable reference, which
+    // may still be written through later. Such a buffer is never shared:
+    // copies take their own until a reallocation retires those references.
+    bool exposed = false;
+
+    static shared_ptr<T> Allocate(int count) {
+        return shared_ptr<T>(new T[count], default_delete<T[]>());
+    }
+
+    void Reallocate(int newCapacity) {
+        shared_ptr<T> newBuffer = Allocate(newCapacity);
+        int copySize = (newCapacity < size) ? newCapacity : size;
+        for (int i = 0; i < copySize; i++) {
+            newBuffer.get()[i] = data[i];
+        }
+        buffer = newBuffer;
+        data = buffer.get();
+        capacity = newCapacity;
+        pin.reset();
+        exposed = false;
+    }
+
+    void Detach() {
+        if (buffer.use_count() > 1) {
+            Unshare();
+        }
+    }
+
+    // A published buffer whose readers are all gone is kept; the fence
+    // pairs with the last reader dropping its reference, so its reads
+    // finish before we write in place. It is paid once per Publish.
+    void Unshare() {
+        if (pin) {
+            pin.reset();
+            if (buffer.use_count() == 1) {
+                atomic_thread_fence(memory_order_acquire);
+                return;
+            }
+        }
+        Reallocate(capacity);
+    }
+
+    void Grow() {
+        if (size == capacity) {
+            Reallocate(capacity < 4 ? 4 : capacity * 2);
+        }
+        else {
+            Detach();
+        }
+    }
+
 public:
 
     DynamicArray() {
         size = 0;
+        capacity = 0;
         data = NULL;
     }
 
-    DynamicArray(T* items, int count) : size(count) {
-        data = new T[count];
+    DynamicArray(T* items, int count) : size(count), capacity(count) {
+        buffer = Allocate(count);
+        data = buffer.get();
         for (int i = 0; i < count; i++) {
             data[i] = items[i];
         }
     }
 
-    DynamicArray(int size) : size(size) {
+    DynamicArray(int size) : size(size), capacity(size) {
         if (size > 0) {
-            data = new T[size];
+            buffer = Allocate(size);
+            data = buffer.get();
         }
         else {
             data = 0;
+            capacity = 0;
+        }
+    }
+
+    // Adopts an existing buffer of count elements, such as a file mapping;
+    // the first reallocation moves the elements to the heap.
+    DynamicArray(const shared_ptr<T>& buffer, int count) : buffer(buffer), data(buffer.get()), size(count), capacity(count) {}
+
+    DynamicArray(const DynamicArray<T, Checking>& dynamicArray)
+        : buffer(dynamicArray.buffer), data(dynamicArray.data), size(dynamicArray.size), capacity(dynamicArray.capacity) {
+        if (dynamicArray.exposed) {
+            Reallocate(size);
         }
     }
 
-    DynamicArray(DynamicArray<T>& dynamicArray) : size(dynamicArray.GetSize()) {
-        data = new T[size];
-        for (int i = 0; i < size; i++) {
-            data[i] = dynamicArray[i];
+    DynamicArray<T, Checking>& operator=(const DynamicArray<T, Checking>& dynamicArray) {
+        buffer = dynamicArray.buffer;
+        data = dynamicArray.data;
+        size = dynamicArray.size;
+        capacity = dynamicArray.capacity;
+        pin.reset();
+        exposed = false;
+        if (dynamicArray.exposed) {
+            Reallocate(size);
         }
+        return *this;
+    }
+
+    // Marks the buffer as shared with a reader on another thread, such as
+    // a snapshot view; see Unshare.
+    void Publish() const {
+        pin = buffer;
+    }
+
+    // Raw access to the elements; unshares the buffer first.
+    T* GetData() {
+        Detach();
+        return data;
+    }
+
+    const T* GetData() const {
+        return data;
     }
 
-    ~DynamicArray() {
-        delete[] data;
+    bool IsShared() const {
+        return buffer.use_count() > (pin ? 2 : 1);
     }
 
     int GetSize() const {
         return size;
     }
 
-    T Get(int index) const  {
-        if (index < 0 || index >= size) {
-            throw IndexOutOfRange();
+    int GetCapacity() const {
+        return capacity;
+    }
+
+    void Reserve(int newCapacity) {
+        if (newCapacity > capacity) {
+            Reallocate(newCapacity);
         }
+    }
+
+    T Get(int index) const  {
+        CheckIndex<Checking>(index, size);
+        return data[index];
+    }
+
+    T GetUnchecked(int index) const {
         return data[index];
     }
 
@@ -109,44 +389,64 @@ public:
         if (index < 0 || index >= size) {
             throw IndexOutOfRange();
         }
+        Detach();
         data[index] = value;
     }
 
     void Resize(int newSize) {
-        T* newData = new T[newSize];
-        int copySize = (newSize < size) ? newSize : size;
-        if (copySize < 0) {
+        if (newSize < 0) {
             throw IndexOutOfRange();
         }
-        for (int i = 0; i < copySize; i++) {
-            newData[i] = data[i];
+        if (newSize > capacity) {
+            Reallocate(newSize);
+        }
+        else {
+            Detach();
         }
-        delete[] data;
-        data = newData;
         size = newSize;
     }
 
     T& operator[](int index) {
-        if (index < 0 || index >= size) {
-            throw IndexOutOfRange();
-        }
+        CheckIndex<Checking>(index, size);
+        Detach();
+        exposed = true;
         return data[index];
     }
 
     const T& operator[](int index) const {
-        if (index < 0 || index >= size) {
-            throw IndexOutOfRange();
-        }
+        CheckIndex<Checking>(index, size);
+        return data[index];
+    }
+
+    T& At(int index) {
+        CheckIndex<AlwaysCheckBounds>(index, size);
+        Detach();
+        exposed = true;
+        return data[index];
+    }
+
+    const T& At(int index) const {
+        CheckIndex<AlwaysCheckBounds>(index, size);
+        return data[index];
+    }
+
+    T& AtUnchecked(int index) {
+        Detach();
+        return data[index];
+    }
+
+    const T& AtUnchecked(int index) const {
         return data[index];
     }
 
     void Append(T item)  {
-        Resize(GetSize() + 1);
-        data[GetSize() - 1] = item;
+        Grow();
+        data[size++] = item;
     }
 
     void Prepend(T item) {
-        Resize(GetSize() + 1);
+        Grow();
+        size++;
         for (int i = GetSize() - 1; i > 0; --i) {
             data[i] = data[i - 1];
         }
@@ -165,16 +465,28 @@ public:
             Append(item);
         }
         else {
-            Resize(GetSize() + 1);
+            Grow();
+            size++;
             for (int i = GetSize() - 1; i > index; i--) {
                 data[i] = data[i - 1];
             }
             data[index] = item;
         }
     }
+
+    void RemoveAt(int index) {
+        if (index < 0 || index >= size) {
+            throw IndexOutOfRange();
+        }
+        Detach();
+        for (int i = index + 1; i < size; i++) {
+            data[i - 1] = data[i];
+        }
+        size--;
+    }
 };
 
-template <class T>
+template <class T, class Checking = AlwaysCheckBounds>
 class LinkedList{
 private:
     struct Node {
@@ -186,17 +498,71 @@ private:
     Node* tail;
     int size;
 
+    // Nodes placed contiguously by Defragment; later nodes are allocated one by one.
+    Node* block;
+    int blockSize;
+
+    bool InBlock(const Node* node) const {
+        return std::less_equal<const Node*>()(block, node) && std::less<const Node*>()(node, block + blockSize);
+    }
+
+    void DeleteNode(Node* node) {
+        if (InBlock(node)) {
+            node->~Node();
+        }
+        else {
+            delete node;
+        }
+    }
+
     Node* GetNode(int index) const {
-        if (index < 0 || index >= size)
-            throw IndexOutOfRange();
+        CheckIndex<Checking>(index, size);
+        return GetNodeUnchecked(index);
+    }
+
+    Node* GetNodeUnchecked(int index) const {
         Node* current = head;
         for (int i = 0; i < index; ++i)
             current = current->next;
         return current;
     }
 
+    // Cuts the chain after count nodes and returns the rest.
+    static Node* Split(Node* node, int count) {
+        for (int i = 1; node != nullptr && i < count; ++i) {
+            node = node->next;
+        }
+        if (node == nullptr) {
+            return nullptr;
+        }
+        Node* rest = node->next;
+        node->next = nullptr;
+        return rest;
+    }
+
 public:
-    LinkedList() : head(nullptr), tail(nullptr), size(0) {}
+    // Forward position in the list; stays valid across Append and Insert.
+    class Cursor {
+    private:
+        const Node* node;
+
+    public:
+        Cursor(const Node* node = nullptr) : node(node) {}
+
+        bool IsValid() const {
+            return node != nullptr;
+        }
+
+        const T& Value() const {
+            return node->data;
+        }
+
+        void Next() {
+            node = node->next;
+        }
+    };
+
+    LinkedList() : head(nullptr), tail(nullptr), size(0), block(nullptr), blockSize(0) {}
 
     LinkedList(T* items, int count) : LinkedList() {
         for (int i = 0; i < count; i++) {
@@ -204,7 +570,7 @@ public:
         }
     }
 
-    LinkedList(LinkedList<T>& list) : LinkedList() {
+    LinkedList(const LinkedList<T, Checking>& list) : LinkedList() {
         Node* current = list.head;
         while (current != nullptr) {
             Append(current->data);
@@ -216,8 +582,9 @@ public:
         while (head != nullptr) {
             Node* temp = head;
             head = head->next;
-            delete temp;
+            DeleteNode(temp);
         }
+        ::operator delete(block);
     }
 
     T GetFirst() {
@@ -238,6 +605,10 @@ public:
         return GetNode(index)->data;
     }
 
+    T GetUnchecked(int index) const {
+        return GetNodeUnchecked(index)->data;
+    }
+
     T& operator[](int index) {
         return GetNode(index)->data;
     }
@@ -246,17 +617,29 @@ public:
         return GetNode(index)->data;
     }
 
+    T& At(int index) {
+        CheckIndex<AlwaysCheckBounds>(index, size);
+        return GetNodeUnchecked(index)->data;
+    }
+
+    const T& At(int index) const {
+        CheckIndex<AlwaysCheckBounds>(index, size);
+        return GetNodeUnchecked(index)->data;
+    }
+
     int GetSize() const  {
         return size;
     }
 
-    LinkedList<T>* GetSubList(int startIndex, int endIndex) {
+    LinkedList<T, Checking>* GetSubList(int startIndex, int endIndex) {
         if (startIndex < 0 || endIndex >= size || startIndex > endIndex) {
             throw IndexOutOfRange();
         }
-        LinkedList<T>* subList = new LinkedList<T>();
+        LinkedList<T, Checking>* subList = new LinkedList<T, Checking>();
+        Node* current = GetNodeUnchecked(startIndex);
         for (int i = startIndex; i <= endIndex; i++) {
-            subList->Append(Get(i));
+            subList->Append(current->data);
+            current = current->next;
         }
         return subList;
     }
@@ -300,8 +683,106 @@ public:
         }
     }
 
-    LinkedList<T>* Concat(LinkedList<T>* list) {
-        LinkedList<T>* newList = new LinkedList<T>(*this);
+    Cursor Begin() const {
+        return Cursor(head);
+    }
+
+    // Bottom-up merge sort that relinks the existing nodes; stable and
+    // allocation-free.
+    template <class Less>
+    void Sort(const Less& less) {
+        for (int width = 1; width < size; width *= 2) {
+            Node* remaining = head;
+            Node** link = &head;
+            while (remaining != nullptr) {
+                Node* left = remaining;
+                Node* right = Split(left, width);
+                remaining = Split(right, width);
+                while (left != nullptr && right != nullptr) {
+                    if (less(right->data, left->data)) {
+                        *link = right;
+                        right = right->next;
+                    }
+                    else {
+                        *link = left;
+                        left = left->next;
+                    }
+                    link = &(*link)->next;
+                }
+                *link = (left != nullptr) ? left : right;
+                while (*link != nullptr) {
+                    tail = *link;
+                    link = &(*link)->next;
+                }
+            }
+        }
+    }
+
+    // Share of links that jump backward in memory or start more than a
+    // cache line past the end of the current node: 0 for a defragmented
+    // list and usually near 0 for one appended in order, higher the more
+    // inserts and removals have scattered it.
+    double GetFragmentation() const {
+        if (size < 2) {
+            return 0.0;
+        }
+        const uintptr_t cacheLine = 64;
+        int scattered = 0;
+        for (Node* current = head; current->next != nullptr; current = current->next) {
+            uintptr_t end = reinterpret_cast<uintptr_t>(current + 1);
+            uintptr_t next = reinterpret_cast<uintptr_t>(current->next);
+            if (next < reinterpret_cast<uintptr_t>(current) || next > end + cacheLine) {
+                scattered++;
+            }
+        }
+        return static_cast<double>(scattered) / (size - 1);
+    }
+
+    // Rebuilds the nodes in traversal order in one contiguous block so that
+    // scans walk memory sequentially. Invalidates cursors and references.
+    void Defragment() {
+        if (size == 0) {
+            return;
+        }
+        Node* newBlock = static_cast<Node*>(::operator new(sizeof(Node) * size));
+        int built = 0;
+        try {
+            for (Node* current = head; current != nullptr; current = current->next) {
+                new (newBlock + built) Node(std::move_if_noexcept(current->data), newBlock + built + 1);
+                built++;
+            }
+        }
+        catch (...) {
+            for (int i = 0; i < built; ++i) {
+                newBlock[i].~Node();
+            }
+            ::operator delete(newBlock);
+            throw;
+        }
+        newBlock[size - 1].next = nullptr;
+
+        while (head != nullptr) {
+            Node* temp = head;
+            head = head->next;
+            DeleteNode(temp);
+        }
+        ::operator delete(block);
+
+        block = newBlock;
+        blockSize = size;
+        head = newBlock;
+        tail = newBlock + size - 1;
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        for (Node* current = head; current != nullptr; current = current->next) {
+            func(current->data);
+        }
+    }
+
+    LinkedList<T, Checking>* Concat(LinkedList<T, Checking>* list) {
+        LinkedList<T, Checking>* newList = new LinkedList<T, Checking>(*this);
         Node* current = list->head;
         while (current != nullptr) {
             newList->Append(current->data);
@@ -311,130 +792,5594 @@ public:
     }
 };
 
+// Runs task(0) .. task(count - 1) on separate threads, the first one on the
+// calling thread, and rethrows the first exception a task raised. When a
+// thread cannot be started, the calling thread runs the remaining tasks
+// itself; the started threads are always joined.
+template <class Task>
+void ParallelFor(int count, Task task) {
+    unique_ptr<thread[]> workers(count > 1 ? new thread[count - 1] : nullptr);
+    unique_ptr<exception_ptr[]> errors(new exception_ptr[count]);
+    auto run = [&task, &errors](int i) {
+        try {
+            task(i);
+        }
+        catch (...) {
+            errors[i] = current_exception();
+        }
+    };
+    int started = 1;
+    try {
+        for (; started < count; ++started) {
+            workers[started - 1] = thread(run, started);
+        }
+    }
+    catch (...) {
+    }
+    for (int i = started; i < count; ++i) {
+        run(i);
+    }
+    run(0);
+    for (int i = 1; i < started; ++i) {
+        workers[i - 1].join();
+    }
+    for (int i = 0; i < count; ++i) {
+        if (errors[i]) {
+            rethrow_exception(errors[i]);
+        }
+    }
+}
+
+// Buffers at least this long are sorted on several threads.
+const int ParallelSortThreshold = 1 << 16;
+
+inline int GetSortThreads(int size) {
+    int threads = static_cast<int>(thread::hardware_concurrency());
+    return max(1, min(threads, size / (ParallelSortThreshold / 2)));
+}
+
+// Radix sort applies only when the comparator is known to be the natural
+// order of an integer type: 1 for std::less, -1 for std::greater.
+template <class T, class Less>
+int GetNaturalOrder(const Less&) {
+    return 0;
+}
+
 template <class T>
-class Sequence : public ICollection<T> {
-public:
-    virtual ~Sequence() = default;
-    virtual T GetFirst() = 0;
-    virtual T GetLast() = 0;
-    virtual T Get(int index) const = 0;
-    virtual Sequence<T>* Instance() = 0;
-    virtual Sequence<T>* Clone() const = 0;
-    virtual Sequence<T>* GetSubSequence(int startIndex, int endIndex) = 0;
-    virtual int GetSize() const = 0;
-    virtual void Append(T item) = 0;
-    virtual void Prepend(T item) = 0;
-    virtual void Insert(T item, int index) = 0;
-    virtual Sequence<T>* Concat(Sequence<T>* list) = 0;
-    virtual Sequence<T>* Map(function<T(T)> func) = 0;
-    virtual Sequence<T>* From(const Sequence<T>& other) = 0;
-    virtual Sequence<T>* Zip(const Sequence<T>& other) const = 0;
-    virtual bool TryGet(int index, T& value) = 0;
-    virtual bool TryFind(function<bool(T)> predicate, T& value) = 0;
-    virtual T& operator[](int index) = 0;
-    virtual const T& operator[](int index) const = 0;
-};
+int GetNaturalOrder(const less<T>&) {
+    return 1;
+}
 
 template <class T>
-class ArraySequence : public Sequence<T> {
-protected:
-    DynamicArray<T>* array;
-public:
+int GetNaturalOrder(const greater<T>&) {
+    return -1;
+}
 
-    ArraySequence() {
-        array = new DynamicArray<T>(0);
+template <class T>
+int GetNaturalOrder(const function<bool(const T&, const T&)>& less) {
+    if (less.template target<std::less<T>>() != nullptr) {
+        return 1;
     }
-
-    ArraySequence(T* items, int count){
-        array = new DynamicArray<T>(items, count);
+    if (less.template target<greater<T>>() != nullptr) {
+        return -1;
     }
+    return 0;
+}
 
-    ArraySequence(const ArraySequence<T>& other) {
-        array = new DynamicArray<T>(*other.array);
-    }
+template <class T>
+bool RadixSort(T*, int, int, false_type) {
+    return false;
+}
 
-    ArraySequence(const Sequence<T>& other) {
-        array = new DynamicArray<T>(0);
-        for (int i = 0; i < other.GetSize(); ++i) {
-            array->Append(other.Get(i));
+// LSD radix sort, one byte per pass; passes where every key shares the byte
+// are skipped. Equal integers are indistinguishable, so it is also stable.
+template <class T>
+bool RadixSort(T* data, int size, int order, true_type) {
+    typedef typename make_unsigned<T>::type Key;
+    const Key flip = is_signed<T>::value ? static_cast<Key>(Key(1) << (sizeof(T) * 8 - 1)) : Key(0);
+    DynamicArray<T> buffer(size);
+    T* from = data;
+    T* to = buffer.GetData();
+    for (unsigned shift = 0; shift < sizeof(T) * 8; shift += 8) {
+        int offsets[257] = {};
+        for (int i = 0; i < size; ++i) {
+            offsets[((static_cast<Key>(from[i]) ^ flip) >> shift & 0xFF) + 1]++;
+        }
+        bool trivial = false;
+        for (int bucket = 1; bucket <= 256; ++bucket) {
+            trivial = trivial || offsets[bucket] == size;
         }
+        if (trivial) {
+            continue;
+        }
+        for (int bucket = 1; bucket <= 256; ++bucket) {
+            offsets[bucket] += offsets[bucket - 1];
+        }
+        for (int i = 0; i < size; ++i) {
+            to[offsets[(static_cast<Key>(from[i]) ^ flip) >> shift & 0xFF]++] = from[i];
+        }
+        swap(from, to);
     }
-
-    ~ArraySequence() {
-        delete array;
+    if (from != data) {
+        copy(from, from + size, data);
     }
-
-    T GetFirst() override {
-        if (array->GetSize() == 0) throw IndexOutOfRange();
-        return array->Get(0);
+    if (order < 0) {
+        reverse(data, data + size);
     }
+    return true;
+}
 
-    T GetLast() override {
-        if (array->GetSize() == 0) throw IndexOutOfRange();
-        return array->Get(array->GetSize() - 1);
+// Sorts a raw buffer: radix sort for integer keys in their natural order,
+// otherwise introsort (or merge sort when stable) over per-thread chunks
+// that are then merged pairwise.
+template <class T, class Less>
+void SortBuffer(T* data, int size, const Less& less, bool stable) {
+    if (size < 2) {
+        return;
     }
-
-    int GetSize() const override {
-        return array->GetSize();
+    int order = GetNaturalOrder<T>(less);
+    if (order != 0 && RadixSort(data, size, order, integral_constant<bool, is_integral<T>::value && !is_same<T, bool>::value>())) {
+        return;
     }
 
-    T Get(int index) const override {
-        return array->Get(index);
+    int chunks = GetSortThreads(size);
+    unique_ptr<int[]> bounds(new int[chunks + 1]);
+    for (int i = 0; i <= chunks; ++i) {
+        bounds[i] = static_cast<int>(static_cast<long long>(size) * i / chunks);
     }
-
-    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+    ParallelFor(chunks, [&](int chunk) {
+        if (stable) {
+            stable_sort(data + bounds[chunk], data + bounds[chunk + 1], less);
+        }
+        else {
+            sort(data + bounds[chunk], data + bounds[chunk + 1], less);
+        }
+    });
+    for (int width = 1; width < chunks; width *= 2) {
+        int merges = (chunks + 2 * width - 1) / (2 * width);
+        ParallelFor(merges, [&](int merge) {
+            int first = merge * 2 * width;
+            int middle = min(first + width, chunks);
+            int last = min(first + 2 * width, chunks);
+            inplace_merge(data + bounds[first], data + bounds[middle], data + bounds[last], less);
+        });
+    }
+}
+
+// Secondary index a sequence can keep over its elements; the owner reports
+// its writes. Sequences hold it through this interface, so element types
+// without a hash only pay for it when an index is actually attached.
+template <class T>
+class SequenceIndex {
+public:
+    virtual ~SequenceIndex() = default;
+    virtual SequenceIndex<T>* Clone() const = 0;
+    virtual bool IsStale() const = 0;
+    virtual void Invalidate() = 0;
+    // Empties the index and marks it current.
+    virtual void Clear() = 0;
+    virtual void Add(const T& value, int position) = 0;
+    virtual void AddFront(const T& value) = 0;
+    virtual void Remove(const T& value, int position) = 0;
+    // Lowest position holding value, or -1. Call Refresh first.
+    virtual int Find(const T& value) const = 0;
+
+    // Follows an insert of value at position into a sequence now newSize long.
+    void Inserted(const T& value, int position, int newSize) {
+        if (position == newSize - 1) {
+            Add(value, position);
+        }
+        else if (position == 0) {
+            AddFront(value);
+        }
+        else {
+            Invalidate();
+        }
+    }
+
+    virtual void Replaced(const T& oldValue, const T& value, int position) {
+        Remove(oldValue, position);
+        Add(value, position);
+    }
+
+    // Follows a write through the reference operator[] returns: the old
+    // value is kept and the entry moved at the next Settle, instead of the
+    // index being rebuilt. get(position) must return the current element;
+    // owners settle before any other use of the index.
+    template <class Get>
+    void Writing(int position, Get get) {
+        Settle(get);
+        if (!IsStale()) {
+            pendingValue = get(position);
+            pendingPosition = position;
+        }
+    }
+
+    template <class Get>
+    void Settle(Get get) {
+        int position = pendingPosition;
+        if (position < 0) {
+            return;
+        }
+        pendingPosition = -1;
+        if (!IsStale()) {
+            Replaced(pendingValue, get(position), position);
+        }
+    }
+
+    // Rebuilds a stale index; forEach(func) must call func on every element
+    // in order.
+    template <class ForEach>
+    void Refresh(ForEach forEach) {
+        if (!IsStale()) {
+            return;
+        }
+        pendingPosition = -1;
+        Clear();
+        int position = 0;
+        forEach([&](const T& item) {
+            Add(item, position++);
+        });
+    }
+
+private:
+    T pendingValue = T();
+    int pendingPosition = -1;
+};
+
+// Open-addressing (linear probing) index from values to the lowest position
+// holding them. Each distinct value has one entry with a count of its
+// positions, so duplicates do not lengthen probe runs. Positions are kept
+// relative to the number of front inserts, so Append and Prepend update it
+// in O(1). A middle insert, a write the owner cannot follow, or removing the
+// lowest of several positions of a value marks it stale and the next lookup
+// rebuilds it.
+template <class T, class Hash = hash<T>>
+class HashIndex : public SequenceIndex<T> {
+private:
+    enum { Free = INT_MIN };
+
+    DynamicArray<T> keys;
+    DynamicArray<int> firsts;
+    DynamicArray<int> counts;
+    int count;
+    int shift;
+    int frontInserts;
+    bool stale;
+    Hash hasher;
+
+    int Capacity() const {
+        return firsts.GetSize();
+    }
+
+    // Fibonacci hashing spreads weak hashes such as the identity for ints.
+    int SlotOf(const T& value) const {
+        unsigned long long mixed = static_cast<unsigned long long>(hasher(value)) * 0x9E3779B97F4A7C15ull;
+        return static_cast<int>(mixed >> shift);
+    }
+
+    // The slot holding value, or the free slot that ends its probe run.
+    int Probe(const T& value) const {
+        int mask = Capacity() - 1;
+        int slot = SlotOf(value);
+        while (firsts.AtUnchecked(slot) != Free && !(keys.AtUnchecked(slot) == value)) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void Reset(int capacity) {
+        keys = DynamicArray<T>(capacity);
+        firsts = DynamicArray<int>(capacity);
+        counts = DynamicArray<int>(capacity);
+        for (int i = 0; i < capacity; ++i) {
+            firsts.AtUnchecked(i) = Free;
+        }
+        shift = 64;
+        for (int bits = capacity; bits > 1; bits /= 2) {
+            shift--;
+        }
+        count = 0;
+    }
+
+    void Place(int slot, const T& value, int first, int occurrences) {
+        keys.AtUnchecked(slot) = value;
+        firsts.AtUnchecked(slot) = first;
+        counts.AtUnchecked(slot) = occurrences;
+        count++;
+    }
+
+    void Grow() {
+        DynamicArray<T> oldKeys = keys;
+        DynamicArray<int> oldFirsts = firsts;
+        DynamicArray<int> oldCounts = counts;
+        Reset(2 * Capacity());
+        for (int i = 0; i < oldFirsts.GetSize(); ++i) {
+            if (oldFirsts.AtUnchecked(i) != Free) {
+                const T& key = oldKeys.AtUnchecked(i);
+                Place(Probe(key), key, oldFirsts.AtUnchecked(i), oldCounts.AtUnchecked(i));
+            }
+        }
+    }
+
+    // Frees slot, closing the gap by shifting later entries of the probe run
+    // back.
+    void Erase(int slot) {
+        int mask = Capacity() - 1;
+        for (int next = (slot + 1) & mask; firsts.AtUnchecked(next) != Free; next = (next + 1) & mask) {
+            int home = SlotOf(keys.AtUnchecked(next));
+            if (((next - home) & mask) >= ((next - slot) & mask)) {
+                keys.AtUnchecked(slot) = keys.AtUnchecked(next);
+                firsts.AtUnchecked(slot) = firsts.AtUnchecked(next);
+                counts.AtUnchecked(slot) = counts.AtUnchecked(next);
+                slot = next;
+            }
+        }
+        firsts.AtUnchecked(slot) = Free;
+        count--;
+    }
+
+public:
+    HashIndex() : frontInserts(0), stale(true) {
+        Reset(16);
+    }
+
+    SequenceIndex<T>* Clone() const override {
+        return new HashIndex<T, Hash>(*this);
+    }
+
+    bool IsStale() const override {
+        return stale;
+    }
+
+    void Invalidate() override {
+        stale = true;
+    }
+
+    void Clear() override {
+        Reset(16);
+        frontInserts = 0;
+        stale = false;
+    }
+
+    void Add(const T& value, int position) override {
+        if (stale) {
+            return;
+        }
+        int stored = position - frontInserts;
+        int slot = Probe(value);
+        if (firsts.AtUnchecked(slot) != Free) {
+            firsts.AtUnchecked(slot) = min(firsts.AtUnchecked(slot), stored);
+            counts.AtUnchecked(slot)++;
+            return;
+        }
+        if (2 * (count + 1) > Capacity()) {
+            Grow();
+            slot = Probe(value);
+        }
+        Place(slot, value, stored, 1);
+    }
+
+    void AddFront(const T& value) override {
+        if (frontInserts == INT_MAX / 2) {
+            stale = true;
+        }
+        frontInserts++;
+        Add(value, 0);
+    }
+
+    // Drops value at position. The next lowest position of a value is not
+    // kept, so removing the lowest of several marks the index stale.
+    void Remove(const T& value, int position) override {
+        if (stale) {
+            return;
+        }
+        int slot = Probe(value);
+        if (firsts.AtUnchecked(slot) == Free) {
+            return;
+        }
+        if (counts.AtUnchecked(slot) == 1) {
+            Erase(slot);
+        }
+        else if (firsts.AtUnchecked(slot) == position - frontInserts) {
+            stale = true;
+        }
+        else {
+            counts.AtUnchecked(slot)--;
+        }
+    }
+
+    // An unchanged value is skipped, so reads through a non-const reference
+    // cost nothing.
+    void Replaced(const T& oldValue, const T& value, int position) override {
+        if (!(oldValue == value)) {
+            SequenceIndex<T>::Replaced(oldValue, value, position);
+        }
+    }
+
+    int Find(const T& value) const override {
+        int first = firsts.AtUnchecked(Probe(value));
+        return first == Free ? -1 : first + frontInserts;
+    }
+};
+
+// Keeps the k first elements in less order seen so far in a max-heap, so a
+// stream of n elements is reduced in O(n log k) time and O(k) memory.
+template <class T, class Less>
+class TopKCollector {
+private:
+    DynamicArray<T> heap;
+    int k;
+    const Less& less;
+
+public:
+    TopKCollector(int k, const Less& less) : heap(0), k(k), less(less) {
+        heap.Reserve(k);
+    }
+
+    void Offer(const T& item) {
+        if (heap.GetSize() < k) {
+            heap.Append(item);
+            T* data = heap.GetData();
+            push_heap(data, data + heap.GetSize(), less);
+        }
+        else if (k > 0 && less(item, heap.AtUnchecked(0))) {
+            T* data = heap.GetData();
+            pop_heap(data, data + k, less);
+            data[k - 1] = item;
+            push_heap(data, data + k, less);
+        }
+    }
+
+    // The collected elements in less order.
+    DynamicArray<T> Take() {
+        T* data = heap.GetData();
+        sort_heap(data, data + heap.GetSize(), less);
+        return heap;
+    }
+};
+
+// Top k over parts of a container: part(i, collector) offers the elements of
+// part i. Large inputs spread the parts over threads and merge the partial
+// results.
+template <class T, class Less, class Part>
+DynamicArray<T> ParallelTopK(int k, const Less& less, int size, int parts, Part part) {
+    int workers = max(1, min(parts, GetSortThreads(size)));
+    DynamicArray<DynamicArray<T>> partial(workers);
+    DynamicArray<T>* results = partial.GetData();
+    ParallelFor(workers, [&](int worker) {
+        TopKCollector<T, Less> collector(k, less);
+        for (int i = worker; i < parts; i += workers) {
+            part(i, collector);
+        }
+        results[worker] = collector.Take();
+    });
+    if (workers == 1) {
+        return results[0];
+    }
+    TopKCollector<T, Less> collector(k, less);
+    for (int worker = 0; worker < workers; ++worker) {
+        for (int i = 0; i < results[worker].GetSize(); ++i) {
+            collector.Offer(results[worker].AtUnchecked(i));
+        }
+    }
+    return collector.Take();
+}
+
+template <class T>
+class ArraySequence;
+
+template <class T>
+class Sequence : public ICollection<T> {
+public:
+    virtual ~Sequence() = default;
+    virtual T GetFirst() = 0;
+    virtual T GetLast() = 0;
+    virtual T Get(int index) const = 0;
+    virtual Sequence<T>* Instance() = 0;
+    virtual Sequence<T>* Clone() const = 0;
+    virtual Sequence<T>* GetSubSequence(int startIndex, int endIndex) = 0;
+    virtual int GetSize() const = 0;
+    virtual void Append(T item) = 0;
+    virtual void Prepend(T item) = 0;
+    virtual void Insert(T item, int index) = 0;
+    virtual Sequence<T>* Concat(Sequence<T>* list) = 0;
+    virtual Sequence<T>* Map(function<T(T)> func) = 0;
+    virtual Sequence<T>* From(const Sequence<T>& other) = 0;
+    virtual Sequence<T>* Zip(const Sequence<T>& other) const = 0;
+    virtual bool TryGet(int index, T& value) = 0;
+    virtual bool TryFind(function<bool(T)> predicate, T& value) = 0;
+    virtual T& operator[](int index) = 0;
+    virtual const T& operator[](int index) const = 0;
+
+    typedef function<bool(const T&, const T&)> Comparator;
+
+    // Sorts in ascending order of less; StableSort keeps equal elements in
+    // their original order. Sorted sequences are already in their own
+    // order and throw UnsupportedOperation for any other comparator.
+    void Sort(const Comparator& less = std::less<T>()) {
+        SortItems(less, false);
+    }
+
+    void StableSort(const Comparator& less = std::less<T>()) {
+        SortItems(less, true);
+    }
+
+    // New sequence with the k first elements in less order (the k smallest
+    // by default), sorted; the sequence itself is left as it is.
+    Sequence<T>* TopK(int k, const Comparator& less = std::less<T>()) const {
+        if (k < 0) {
+            throw IndexOutOfRange();
+        }
+        return SelectTopK(min(k, GetSize()), less);
+    }
+
+    // Elements in first-occurrence order without repeats. These set
+    // operations hash the elements (std::hash and operator==) and take
+    // O(n + m) expected time; the result is a new ArraySequence.
+    Sequence<T>* Distinct() const {
+        HashIndex<T> emitted;
+        emitted.Clear();
+        ArraySequence<T>* result = new ArraySequence<T>();
+        Visit([&](const T& item) {
+            if (emitted.Find(item) == -1) {
+                emitted.Add(item, 0);
+                result->Append(item);
+            }
+        });
+        return result;
+    }
+
+    Sequence<T>* Union(const Sequence<T>& other) const {
+        HashIndex<T> emitted;
+        emitted.Clear();
+        ArraySequence<T>* result = new ArraySequence<T>();
+        auto add = [&](const T& item) {
+            if (emitted.Find(item) == -1) {
+                emitted.Add(item, 0);
+                result->Append(item);
+            }
+        };
+        Visit(add);
+        other.Visit(add);
+        return result;
+    }
+
+    // Distinct elements of this sequence that also occur in other.
+    Sequence<T>* Intersect(const Sequence<T>& other) const {
+        return Filter(other, true);
+    }
+
+    // Distinct elements of this sequence that do not occur in other.
+    Sequence<T>* Except(const Sequence<T>& other) const {
+        return Filter(other, false);
+    }
+
+    // Calls visitor on every element in order. The fallback goes through
+    // Get; containers with slow indexing override it.
+    virtual void Visit(const function<void(const T&)>& visitor) const {
+        for (int i = 0; i < GetSize(); ++i) {
+            visitor(Get(i));
+        }
+    }
+
+protected:
+    Sequence<T>* Filter(const Sequence<T>& other, bool inOther) const {
+        HashIndex<T> present;
+        present.Clear();
+        other.Visit([&](const T& item) {
+            if (present.Find(item) == -1) {
+                present.Add(item, 0);
+            }
+        });
+        HashIndex<T> emitted;
+        emitted.Clear();
+        ArraySequence<T>* result = new ArraySequence<T>();
+        Visit([&](const T& item) {
+            if ((present.Find(item) != -1) == inOther && emitted.Find(item) == -1) {
+                emitted.Add(item, 0);
+                result->Append(item);
+            }
+        });
+        return result;
+    }
+
+    // Fallback through Get; containers with slow indexing stream instead.
+    virtual Sequence<T>* SelectTopK(int k, const Comparator& less) const {
+        TopKCollector<T, Comparator> collector(k, less);
+        for (int i = 0; i < GetSize(); ++i) {
+            collector.Offer(Get(i));
+        }
+        DynamicArray<T> items = collector.Take();
+        return new ArraySequence<T>(items.GetData(), items.GetSize());
+    }
+
+    // Fallback for containers without a sort of their own: sort a copy and
+    // write it back through operator[].
+    virtual void SortItems(const Comparator& less, bool stable) {
+        int size = GetSize();
+        DynamicArray<T> items(size);
+        for (int i = 0; i < size; ++i) {
+            items.AtUnchecked(i) = Get(i);
+        }
+        SortBuffer(items.GetData(), size, less, stable);
+        for (int i = 0; i < size; ++i) {
+            (*this)[i] = items.AtUnchecked(i);
+        }
+    }
+};
+
+template <class T>
+class ArraySequence : public Sequence<T> {
+protected:
+    DynamicArray<T>* array;
+    unique_ptr<SequenceIndex<T>> hashIndex;
+    mutable uint64_t epoch = 0;
+
+    // Applies a pending write through operator[] to the index.
+    void SettleIndex() const {
+        if (hashIndex) {
+            hashIndex->Settle([this](int position) {
+                return array->Get(position);
+            });
+        }
+    }
+public:
+
+    // Read-only view of the elements as of one epoch; see Snapshot.
+    class View {
+    private:
+        DynamicArray<T> items;
+        uint64_t epoch;
+
+    public:
+        View(const DynamicArray<T>& items, uint64_t epoch) : items(items), epoch(epoch) {}
+
+        uint64_t GetEpoch() const {
+            return epoch;
+        }
+
+        int GetSize() const {
+            return items.GetSize();
+        }
+
+        T Get(int index) const {
+            return items.Get(index);
+        }
+
+        const T& operator[](int index) const {
+            if (index < 0 || index >= items.GetSize()) throw IndexOutOfRange();
+            return items.AtUnchecked(index);
+        }
+
+        template <class Func>
+        void ForEach(Func func) const {
+            for (int i = 0; i < items.GetSize(); ++i) {
+                func(items.AtUnchecked(i));
+            }
+        }
+    };
+
+    ArraySequence() {
+        array = new DynamicArray<T>(0);
+    }
+
+    ArraySequence(T* items, int count){
+        array = new DynamicArray<T>(items, count);
+    }
+
+    // Shares the buffer of items until either side writes.
+    explicit ArraySequence(const DynamicArray<T>& items) {
+        array = new DynamicArray<T>(items);
+    }
+
+    ArraySequence(const ArraySequence<T>& other)
+        : hashIndex(other.hashIndex ? other.hashIndex->Clone() : nullptr) {
+        array = new DynamicArray<T>(*other.array);
+    }
+
+    ArraySequence(const Sequence<T>& other) {
+        array = new DynamicArray<T>(0);
+        for (int i = 0; i < other.GetSize(); ++i) {
+            array->Append(other.Get(i));
+        }
+    }
+
+    ~ArraySequence() {
+        delete array;
+    }
+
+    // Makes room for capacity elements, so appends up to it do not reallocate.
+    void Reserve(int capacity) {
+        array->Reserve(capacity);
+    }
+
+    // O(1) view stamped with the current epoch, which then advances. The
+    // view shares the buffer, so the writer's next change copies it once;
+    // old buffers go away with the last view using them. Take snapshots on
+    // the writer's thread; the views can then be read on any thread while
+    // the writer goes on. A buffer written through a reference from
+    // operator[] is copied into the view instead (see operator[]), so such
+    // a write cannot reach the view.
+    View Snapshot() const {
+        array->Publish();
+        return View(*array, epoch++);
+    }
+
+    // Epoch the writes made now belong to.
+    uint64_t GetEpoch() const {
+        return epoch;
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        for (int i = 0; i < array->GetSize(); ++i) {
+            func(array->AtUnchecked(i));
+        }
+    }
+
+    // Attaches a hash index so IndexOf and Contains take O(1) expected time;
+    // Append, Prepend, Insert and Set keep it current, and a write through
+    // operator[] is applied at the next operation. Middle inserts and bulk
+    // rewrites make the next lookup rebuild it.
+    void AttachIndex() {
+        if (!hashIndex) {
+            hashIndex.reset(new HashIndex<T>());
+        }
+    }
+
+    void DetachIndex() {
+        hashIndex.reset();
+    }
+
+    bool HasIndex() const {
+        return hashIndex != nullptr;
+    }
+
+    // Brings a stale index up to date, so it is not safe to call from
+    // several threads at once while an index is attached.
+    int IndexOf(const T& value) const {
+        if (hashIndex) {
+            SettleIndex();
+            hashIndex->Refresh([this](auto func) {
+                ForEach(func);
+            });
+            return hashIndex->Find(value);
+        }
+        for (int i = 0; i < array->GetSize(); ++i) {
+            if (array->AtUnchecked(i) == value) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    bool Contains(const T& value) const {
+        return IndexOf(value) != -1;
+    }
+
+    void Set(int index, T value) {
+        SettleIndex();
+        T oldValue = array->Get(index);
+        array->Set(index, value);
+        if (hashIndex) {
+            hashIndex->Replaced(oldValue, value, index);
+        }
+    }
+
+    // Introselect on the buffer: afterwards position n holds the element a
+    // full sort would put there, with nothing ordered after it before n and
+    // nothing ordered before it after n. Returns that element.
+    T NthElement(int n, const typename Sequence<T>::Comparator& less = std::less<T>()) {
+        if (n < 0 || n >= array->GetSize()) {
+            throw IndexOutOfRange();
+        }
+        T* data = array->GetData();
+        nth_element(data, data + n, data + array->GetSize(), less);
+        if (hashIndex) {
+            hashIndex->Invalidate();
+        }
+        return data[n];
+    }
+
+    // Puts the k first elements in less order at the front, sorted; the
+    // rest are left in unspecified order. Selection is O(n) and the prefix
+    // goes through SortBuffer, which runs in parallel for large k.
+    void PartialSort(int k, const typename Sequence<T>::Comparator& less = std::less<T>()) {
+        if (k < 0 || k > array->GetSize()) {
+            throw IndexOutOfRange();
+        }
+        if (k == 0) {
+            return;
+        }
+        T* data = array->GetData();
+        if (k < array->GetSize()) {
+            nth_element(data, data + k - 1, data + array->GetSize(), less);
+        }
+        SortBuffer(data, k, less, false);
+        if (hashIndex) {
+            hashIndex->Invalidate();
+        }
+    }
+
+    // Drops repeated elements in place, keeping first occurrences in order.
+    void DistinctInPlace() {
+        HashIndex<T> emitted;
+        emitted.Clear();
+        T* data = array->GetData();
+        int kept = 0;
+        for (int i = 0; i < array->GetSize(); ++i) {
+            if (emitted.Find(data[i]) == -1) {
+                emitted.Add(data[i], 0);
+                data[kept++] = data[i];
+            }
+        }
+        array->Resize(kept);
+        if (hashIndex) {
+            hashIndex->Invalidate();
+        }
+    }
+
+    T GetFirst() override {
+        if (array->GetSize() == 0) throw IndexOutOfRange();
+        return array->Get(0);
+    }
+
+    T GetLast() override {
+        if (array->GetSize() == 0) throw IndexOutOfRange();
+        return array->Get(array->GetSize() - 1);
+    }
+
+    int GetSize() const override {
+        return array->GetSize();
+    }
+
+    T Get(int index) const override {
+        return array->Get(index);
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
         if (startIndex < 0 || endIndex >= array->GetSize() || startIndex > endIndex) {
             throw IndexOutOfRange();
         }
-        ArraySequence<T>* subSequence = new ArraySequence<T>();
-        for (int i = startIndex; i <= endIndex; i++) {
-            subSequence->Append(array->Get(i));
+        ArraySequence<T>* subSequence = new ArraySequence<T>();
+        for (int i = startIndex; i <= endIndex; i++) {
+            subSequence->Append(array->GetUnchecked(i));
+        }
+        return subSequence;
+    }
+
+    void Append(T item) override {
+        SettleIndex();
+        array->Append(item);
+        if (hashIndex) {
+            hashIndex->Add(item, array->GetSize() - 1);
+        }
+    }
+
+    void Prepend(T item) override {
+        SettleIndex();
+        array->Prepend(item);
+        if (hashIndex) {
+            hashIndex->AddFront(item);
+        }
+    }
+
+    void Insert(T item, int index) override {
+        SettleIndex();
+        array->Insert(item, index);
+        if (hashIndex) {
+            hashIndex->Inserted(item, index, array->GetSize());
+        }
+    }
+
+    Sequence<T>* Concat(Sequence<T>* list) override {
+        ArraySequence<T>* newSequence = new ArraySequence<T>(*this);
+        for (int i = 0; i < list->GetSize(); ++i) {
+            newSequence->Append(list->Get(i));
+        }
+        return newSequence;
+    }
+
+    Sequence<T>* Map(function<T(T)> func) override {
+        ArraySequence<T>* newSequence = new ArraySequence<T>();
+        for (int i = 0; i < array->GetSize(); ++i) {
+            newSequence->Append(func(array->GetUnchecked(i)));
+        }
+        return newSequence;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override{
+        Sequence<T>* result = new ArraySequence<T>();
+        for (int i = 0; i < other.GetSize(); ++i) {
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+    
+    // Interleaves the two sequences; the typed pairwise form is the free
+    // Zip/ZipView/Unzip further down.
+    Sequence<T>* Zip(const Sequence<T>& other) const override {
+        ArraySequence<T>* result = new ArraySequence<T>();
+        int minSize = min(this->GetSize(), other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(this->Get(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    //Optional<T> TryGet(int index) override {
+    //    if (index < 0 || index >= array->GetSize()) {
+    //        return Optional::None();
+    //    }
+    //    auto value = array->Get(index);
+    //    return Optional<T>(value);
+    //}
+    bool TryGet(int index, T& value) override {
+        if (index < 0 || index >= array->GetSize()) {
+            return false;
+        }
+        value = array->GetUnchecked(index);
+        return true;
+    }
+
+    bool TryFind(std::function<bool(T)> predicate, T& value) override {
+        for (int i = 0; i < array->GetSize(); i++) {
+            if (predicate(array->GetUnchecked(i))) {
+                value = array->GetUnchecked(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The reference may be written through later, so until the buffer next
+    // reallocates, Clone and Snapshot copy it instead of sharing it; Set
+    // keeps them O(1).
+    T& operator[](int index) override {
+        if (hashIndex) {
+            hashIndex->Writing(index, [this](int position) {
+                return array->Get(position);
+            });
+        }
+        return (*array)[index];
+    }
+
+    const T& operator[](int index) const override {
+        return (*array)[index];
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new ArraySequence<T>(*this);
+    }
+
+protected:
+    Sequence<T>* SelectTopK(int k, const typename Sequence<T>::Comparator& less) const override {
+        const DynamicArray<T>& buffer = *array;
+        const T* data = buffer.GetData();
+        int size = buffer.GetSize();
+        int parts = GetSortThreads(size);
+        DynamicArray<T> items = ParallelTopK<T>(k, less, size, parts, [&](int part, TopKCollector<T, typename Sequence<T>::Comparator>& collector) {
+            int end = static_cast<int>(static_cast<long long>(size) * (part + 1) / parts);
+            for (int i = static_cast<int>(static_cast<long long>(size) * part / parts); i < end; ++i) {
+                collector.Offer(data[i]);
+            }
+        });
+        return new ArraySequence<T>(items.GetData(), items.GetSize());
+    }
+
+    void SortItems(const typename Sequence<T>::Comparator& less, bool stable) override {
+        SortBuffer(array->GetData(), array->GetSize(), less, stable);
+        if (hashIndex) {
+            hashIndex->Invalidate();
+        }
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        ForEach(visitor);
+    }
+};
+
+template <class T>
+class MutableArraySequence : public ArraySequence<T> {
+public:
+    using ArraySequence<T>::ArraySequence;
+
+    MutableArraySequence() : ArraySequence<T>() {}
+
+    MutableArraySequence(T* items, int count) : ArraySequence<T>(items, count) {}
+
+    MutableArraySequence(const MutableArraySequence<T>& other) : ArraySequence<T>(other) {}
+
+    MutableArraySequence(const Sequence<T>& other) : ArraySequence<T>(other) {}
+
+    Sequence<T>* Instance() {
+        return this;
+    }
+
+    Sequence<T>* Clone() const {
+        return new MutableArraySequence<T>(*this);
+    }
+};
+
+// Branchless binary searches over a sorted buffer: the step is a conditional
+// move rather than a branch, so probes cost no mispredictions.
+template <class T, class Compare>
+int LowerBoundIn(const T* data, int size, const T& value, const Compare& compare) {
+    if (size == 0) {
+        return 0;
+    }
+    const T* base = data;
+    while (size > 1) {
+        int half = size / 2;
+        base = compare(base[half], value) ? base + half : base;
+        size -= half;
+    }
+    return static_cast<int>(base - data) + (compare(*base, value) ? 1 : 0);
+}
+
+template <class T, class Compare>
+int UpperBoundIn(const T* data, int size, const T& value, const Compare& compare) {
+    if (size == 0) {
+        return 0;
+    }
+    const T* base = data;
+    while (size > 1) {
+        int half = size / 2;
+        base = compare(value, base[half]) ? base : base + half;
+        size -= half;
+    }
+    return static_cast<int>(base - data) + (compare(value, *base) ? 0 : 1);
+}
+
+// Sorted sequences cannot be reordered; a sort request is accepted only when
+// less wraps their own Compare, which leaves them as they are.
+template <class Compare, class Comparator>
+void RequireOwnOrder(const Comparator& less) {
+    if (!less.template target<Compare>()) {
+        throw UnsupportedOperation("Sorted sequence cannot be sorted by another order");
+    }
+}
+
+// Array kept in Compare order. Append, Prepend and positional Insert all
+// place the item at its ordered position (after equal elements), and Set
+// moves the new value to its place. A reference from operator[] could break
+// the order, so only the const one is available; the non-const one throws
+// UnsupportedOperation.
+template <class T, class Compare = std::less<T>>
+class SortedArraySequence : public ArraySequence<T> {
+private:
+    Compare compare;
+
+    // One merge pass over two sorted arrays; each run of equivalent
+    // elements is emitted once if it occurs on the sides the flags select.
+    Sequence<T>* Merge(const SortedArraySequence<T, Compare>& other, bool onlyThis, bool both, bool onlyOther) const {
+        const DynamicArray<T>& a = *this->array;
+        const DynamicArray<T>& b = *other.array;
+        SortedArraySequence<T, Compare>* result = new SortedArraySequence<T, Compare>(compare);
+        int i = 0;
+        int j = 0;
+        while (i < a.GetSize() || j < b.GetSize()) {
+            bool inThis = i < a.GetSize() && (j == b.GetSize() || !compare(b.AtUnchecked(j), a.AtUnchecked(i)));
+            bool inOther = j < b.GetSize() && (i == a.GetSize() || !compare(a.AtUnchecked(i), b.AtUnchecked(j)));
+            const T value = inThis ? a.AtUnchecked(i) : b.AtUnchecked(j);
+            if (inThis && inOther ? both : (inThis ? onlyThis : onlyOther)) {
+                result->array->Append(value);
+            }
+            while (i < a.GetSize() && !compare(value, a.AtUnchecked(i))) {
+                i++;
+            }
+            while (j < b.GetSize() && !compare(value, b.AtUnchecked(j))) {
+                j++;
+            }
+        }
+        return result;
+    }
+
+public:
+    SortedArraySequence(const Compare& compare = Compare()) : ArraySequence<T>(), compare(compare) {}
+
+    SortedArraySequence(T* items, int count, const Compare& compare = Compare())
+        : ArraySequence<T>(items, count), compare(compare) {
+        SortBuffer(this->array->GetData(), count, compare, true);
+    }
+
+    SortedArraySequence(const SortedArraySequence<T, Compare>& other) : ArraySequence<T>(other), compare(other.compare) {}
+
+    SortedArraySequence(const Sequence<T>& other, const Compare& compare = Compare())
+        : ArraySequence<T>(other), compare(compare) {
+        SortBuffer(this->array->GetData(), this->array->GetSize(), compare, true);
+    }
+
+    // Index of the first element not ordered before value.
+    int LowerBound(const T& value) const {
+        const DynamicArray<T>& items = *this->array;
+        return LowerBoundIn(items.GetData(), items.GetSize(), value, compare);
+    }
+
+    // Index of the first element ordered after value.
+    int UpperBound(const T& value) const {
+        const DynamicArray<T>& items = *this->array;
+        return UpperBoundIn(items.GetData(), items.GetSize(), value, compare);
+    }
+
+    bool Contains(const T& value) const {
+        int index = LowerBound(value);
+        return index < this->array->GetSize() && !compare(value, this->array->AtUnchecked(index));
+    }
+
+    // Half-open range [first, second) of elements equivalent to value.
+    pair<int, int> EqualRange(const T& value) const {
+        return make_pair(LowerBound(value), UpperBound(value));
+    }
+
+    using ArraySequence<T>::Union;
+    using ArraySequence<T>::Intersect;
+    using ArraySequence<T>::Except;
+
+    // Merge-based set operations against a sequence with the same order:
+    // O(n + m) without hashing, and the result stays sorted.
+    Sequence<T>* Union(const SortedArraySequence<T, Compare>& other) const {
+        return Merge(other, true, true, true);
+    }
+
+    Sequence<T>* Intersect(const SortedArraySequence<T, Compare>& other) const {
+        return Merge(other, false, true, false);
+    }
+
+    Sequence<T>* Except(const SortedArraySequence<T, Compare>& other) const {
+        return Merge(other, true, false, false);
+    }
+
+    Sequence<T>* Distinct() const {
+        return Merge(SortedArraySequence<T, Compare>(compare), true, false, false);
+    }
+
+    // Equivalent elements are adjacent, so one pass keeps the first of each run.
+    void DistinctInPlace() {
+        T* data = this->array->GetData();
+        int kept = 0;
+        for (int i = 0; i < this->array->GetSize(); ++i) {
+            if (kept == 0 || compare(data[kept - 1], data[i])) {
+                data[kept++] = data[i];
+            }
+        }
+        this->array->Resize(kept);
+        if (this->hashIndex) {
+            this->hashIndex->Invalidate();
+        }
+    }
+
+    // Replaces the element at index and moves the new value to its ordered
+    // position, which is returned.
+    int Set(int index, T value) {
+        const DynamicArray<T>& items = *this->array;
+        if (index < 0 || index >= items.GetSize()) {
+            throw IndexOutOfRange();
+        }
+        bool afterPrevious = index == 0 || !compare(value, items.AtUnchecked(index - 1));
+        bool beforeNext = index == items.GetSize() - 1 || !compare(items.AtUnchecked(index + 1), value);
+        if (afterPrevious && beforeNext) {
+            ArraySequence<T>::Set(index, value);
+            return index;
+        }
+        this->SettleIndex();
+        this->array->RemoveAt(index);
+        if (this->hashIndex) {
+            this->hashIndex->Invalidate();
+        }
+        return Insert(value);
+    }
+
+    // Already in order, so the n-th element is the one at n; selecting or
+    // partially sorting by another order would break it.
+    T NthElement(int n) const {
+        if (n < 0 || n >= this->array->GetSize()) {
+            throw IndexOutOfRange();
+        }
+        return this->array->GetUnchecked(n);
+    }
+
+    void PartialSort(int k, const typename Sequence<T>::Comparator& less = std::less<T>()) = delete;
+
+    // Ordered insert; returns the position the item landed at.
+    int Insert(T item) {
+        int index = UpperBound(item);
+        this->SettleIndex();
+        this->array->Insert(item, index);
+        if (this->hashIndex) {
+            this->hashIndex->Inserted(item, index, this->array->GetSize());
+        }
+        return index;
+    }
+
+    void Append(T item) override {
+        Insert(item);
+    }
+
+    void Prepend(T item) override {
+        Insert(item);
+    }
+
+    void Insert(T item, int index) override {
+        if (index < 0 || index > this->array->GetSize()) {
+            throw IndexOutOfRange();
+        }
+        Insert(item);
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= this->array->GetSize() || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        SortedArraySequence<T, Compare>* subSequence = new SortedArraySequence<T, Compare>(compare);
+        for (int i = startIndex; i <= endIndex; i++) {
+            subSequence->array->Append(this->array->GetUnchecked(i));
+        }
+        return subSequence;
+    }
+
+    Sequence<T>* Concat(Sequence<T>* list) override {
+        SortedArraySequence<T, Compare>* newSequence = new SortedArraySequence<T, Compare>(*this);
+        for (int i = 0; i < list->GetSize(); ++i) {
+            newSequence->Insert(list->Get(i));
+        }
+        return newSequence;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override {
+        return new SortedArraySequence<T, Compare>(other, compare);
+    }
+
+    using ArraySequence<T>::operator[];
+
+    T& operator[](int) override {
+        throw UnsupportedOperation("Sorted sequence elements are changed through Set");
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new SortedArraySequence<T, Compare>(*this);
+    }
+
+protected:
+    // The order is fixed by Compare; sorting by it is a no-op.
+    void SortItems(const typename Sequence<T>::Comparator& less, bool) override {
+        RequireOwnOrder<Compare>(less);
+    }
+};
+
+// Sorted sequence for large sizes: bounded sorted segments with a routing
+// array of their first elements and start positions, so an ordered insert
+// shifts one segment and a lookup probes two small arrays. As with
+// SortedArraySequence, writes go through Set and the non-const operator[]
+// throws, since a write through it would leave the routing stale.
+template <class T, class Compare = std::less<T>>
+class SortedSegmentedSequence : public Sequence<T> {
+private:
+    DynamicArray<DynamicArray<T>> segments;
+    DynamicArray<T> firsts;
+    DynamicArray<int> starts;
+    int size;
+    int segmentSize;
+    Compare compare;
+
+    // Segment that a search for value has to look in.
+    int RouteLower(const T& value) const {
+        return max(0, LowerBoundIn(firsts.GetData(), firsts.GetSize(), value, compare) - 1);
+    }
+
+    int RouteUpper(const T& value) const {
+        return max(0, UpperBoundIn(firsts.GetData(), firsts.GetSize(), value, compare) - 1);
+    }
+
+    int SegmentOf(int index) const {
+        return UpperBoundIn(starts.GetData(), starts.GetSize(), index, std::less<int>()) - 1;
+    }
+
+    void Split(int segmentIndex) {
+        DynamicArray<T>& segment = segments.AtUnchecked(segmentIndex);
+        int half = segment.GetSize() / 2;
+        DynamicArray<T> upper(segment.GetSize() - half);
+        for (int i = half; i < segment.GetSize(); ++i) {
+            upper.AtUnchecked(i - half) = segment.AtUnchecked(i);
+        }
+        segment.Resize(half);
+        segments.Insert(upper, segmentIndex + 1);
+        firsts.Insert(upper.AtUnchecked(0), segmentIndex + 1);
+        starts.Insert(starts.AtUnchecked(segmentIndex) + half, segmentIndex + 1);
+    }
+
+    void RemoveAt(int index) {
+        int segmentIndex = SegmentOf(index);
+        DynamicArray<T>& segment = segments.AtUnchecked(segmentIndex);
+        segment.RemoveAt(index - starts.AtUnchecked(segmentIndex));
+        if (segment.GetSize() == 0) {
+            segments.RemoveAt(segmentIndex);
+            firsts.RemoveAt(segmentIndex);
+            starts.RemoveAt(segmentIndex);
+        }
+        else {
+            firsts.AtUnchecked(segmentIndex) = segment.AtUnchecked(0);
+            segmentIndex++;
+        }
+        for (int i = segmentIndex; i < starts.GetSize(); ++i) {
+            starts.AtUnchecked(i)--;
+        }
+        size--;
+    }
+
+public:
+    SortedSegmentedSequence(const Compare& compare = Compare())
+        : size(0), segmentSize(SequenceTuning<T>::GetSegmentSize()), compare(compare) {}
+
+    SortedSegmentedSequence(T* items, int count, const Compare& compare = Compare())
+        : SortedSegmentedSequence(compare) {
+        for (int i = 0; i < count; ++i) {
+            Insert(items[i]);
+        }
+    }
+
+    SortedSegmentedSequence(const SortedSegmentedSequence<T, Compare>& other)
+        : segments(other.segments), firsts(other.firsts), starts(other.starts),
+          size(other.size), segmentSize(other.segmentSize), compare(other.compare) {}
+
+    SortedSegmentedSequence(const Sequence<T>& other, const Compare& compare = Compare())
+        : SortedSegmentedSequence(compare) {
+        for (int i = 0; i < other.GetSize(); ++i) {
+            Insert(other.Get(i));
+        }
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        for (int i = 0; i < segments.GetSize(); ++i) {
+            const DynamicArray<T>& segment = segments.AtUnchecked(i);
+            for (int j = 0; j < segment.GetSize(); ++j) {
+                func(segment.AtUnchecked(j));
+            }
+        }
+    }
+
+    int LowerBound(const T& value) const {
+        if (size == 0) {
+            return 0;
+        }
+        int segmentIndex = RouteLower(value);
+        const DynamicArray<T>& segment = segments.AtUnchecked(segmentIndex);
+        return starts.AtUnchecked(segmentIndex) + LowerBoundIn(segment.GetData(), segment.GetSize(), value, compare);
+    }
+
+    int UpperBound(const T& value) const {
+        if (size == 0) {
+            return 0;
+        }
+        int segmentIndex = RouteUpper(value);
+        const DynamicArray<T>& segment = segments.AtUnchecked(segmentIndex);
+        return starts.AtUnchecked(segmentIndex) + UpperBoundIn(segment.GetData(), segment.GetSize(), value, compare);
+    }
+
+    bool Contains(const T& value) const {
+        if (size == 0) {
+            return false;
+        }
+        // The last segment starting at or before value holds it if any does.
+        const DynamicArray<T>& segment = segments.AtUnchecked(RouteUpper(value));
+        int index = LowerBoundIn(segment.GetData(), segment.GetSize(), value, compare);
+        return index < segment.GetSize() && !compare(value, segment.AtUnchecked(index));
+    }
+
+    pair<int, int> EqualRange(const T& value) const {
+        return make_pair(LowerBound(value), UpperBound(value));
+    }
+
+    // Ordered insert; returns the position the item landed at. Segments
+    // split in half once they reach twice the tuned segment size.
+    int Insert(T item) {
+        if (size == 0) {
+            segments.Append(DynamicArray<T>(&item, 1));
+            firsts.Append(item);
+            starts.Append(0);
+            size++;
+            return 0;
+        }
+        int segmentIndex = RouteUpper(item);
+        DynamicArray<T>& segment = segments.AtUnchecked(segmentIndex);
+        int position = UpperBoundIn(segment.GetData(), segment.GetSize(), item, compare);
+        segment.Insert(item, position);
+        if (position == 0) {
+            firsts.AtUnchecked(segmentIndex) = item;
+        }
+        for (int i = segmentIndex + 1; i < starts.GetSize(); ++i) {
+            starts.AtUnchecked(i)++;
+        }
+        size++;
+        int index = starts.AtUnchecked(segmentIndex) + position;
+        if (segment.GetSize() >= 2 * segmentSize) {
+            Split(segmentIndex);
+        }
+        return index;
+    }
+
+    // Replaces the element at index and moves the new value to its ordered
+    // position, which is returned.
+    int Set(int index, T value) {
+        if (index < 0 || index >= size) throw IndexOutOfRange();
+        bool afterPrevious = index == 0 || !compare(value, Get(index - 1));
+        bool beforeNext = index == size - 1 || !compare(Get(index + 1), value);
+        if (afterPrevious && beforeNext) {
+            int segmentIndex = SegmentOf(index);
+            int position = index - starts.AtUnchecked(segmentIndex);
+            segments.AtUnchecked(segmentIndex).AtUnchecked(position) = value;
+            if (position == 0) {
+                firsts.AtUnchecked(segmentIndex) = value;
+            }
+            return index;
+        }
+        RemoveAt(index);
+        return Insert(value);
+    }
+
+    T GetFirst() override {
+        if (size == 0) throw IndexOutOfRange();
+        return firsts.AtUnchecked(0);
+    }
+
+    T GetLast() override {
+        if (size == 0) throw IndexOutOfRange();
+        const DynamicArray<T>& last = segments.AtUnchecked(segments.GetSize() - 1);
+        return last.AtUnchecked(last.GetSize() - 1);
+    }
+
+    T Get(int index) const override {
+        return (*this)[index];
+    }
+
+    int GetSize() const override {
+        return size;
+    }
+
+    void Append(T item) override {
+        Insert(item);
+    }
+
+    void Prepend(T item) override {
+        Insert(item);
+    }
+
+    void Insert(T item, int index) override {
+        if (index < 0 || index > size) {
+            throw IndexOutOfRange();
+        }
+        Insert(item);
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= size || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        SortedSegmentedSequence<T, Compare>* subSequence = new SortedSegmentedSequence<T, Compare>(compare);
+        for (int i = startIndex; i <= endIndex; ++i) {
+            subSequence->Insert(Get(i));
+        }
+        return subSequence;
+    }
+
+    Sequence<T>* Concat(Sequence<T>* list) override {
+        SortedSegmentedSequence<T, Compare>* result = new SortedSegmentedSequence<T, Compare>(*this);
+        for (int i = 0; i < list->GetSize(); ++i) {
+            result->Insert(list->Get(i));
+        }
+        return result;
+    }
+
+    // The mapped values need not be ordered, so the result is a plain array.
+    Sequence<T>* Map(function<T(T)> func) override {
+        ArraySequence<T>* result = new ArraySequence<T>();
+        ForEach([&](const T& item) {
+            result->Append(func(item));
+        });
+        return result;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override {
+        return new SortedSegmentedSequence<T, Compare>(other, compare);
+    }
+
+    Sequence<T>* Zip(const Sequence<T>& other) const override {
+        ArraySequence<T>* result = new ArraySequence<T>();
+        int minSize = min(this->GetSize(), other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(this->Get(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    bool TryGet(int index, T& value) override {
+        if (index < 0 || index >= size) {
+            return false;
+        }
+        value = Get(index);
+        return true;
+    }
+
+    bool TryFind(std::function<bool(T)> predicate, T& value) override {
+        for (int i = 0; i < segments.GetSize(); ++i) {
+            const DynamicArray<T>& segment = segments.AtUnchecked(i);
+            for (int j = 0; j < segment.GetSize(); ++j) {
+                if (predicate(segment.AtUnchecked(j))) {
+                    value = segment.AtUnchecked(j);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    T& operator[](int) override {
+        throw UnsupportedOperation("Sorted sequence elements are changed through Set");
+    }
+
+    const T& operator[](int index) const override {
+        if (index < 0 || index >= size) throw IndexOutOfRange();
+        int segmentIndex = SegmentOf(index);
+        return segments.AtUnchecked(segmentIndex).AtUnchecked(index - starts.AtUnchecked(segmentIndex));
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new SortedSegmentedSequence<T, Compare>(*this);
+    }
+
+protected:
+    void SortItems(const typename Sequence<T>::Comparator& less, bool) override {
+        RequireOwnOrder<Compare>(less);
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        ForEach(visitor);
+    }
+};
+
+// On-disk layout read by MappedArraySequence: this header, zero padding up
+// to dataOffset, then count elements of elementSize bytes in native byte
+// order. The checksum is 64-bit FNV-1a over the element bytes.
+struct SequenceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t elementSize;
+    uint32_t alignment;
+    uint64_t count;
+    uint64_t dataOffset;
+    uint64_t checksum;
+};
+
+const char SequenceFileMagic[8] = {'S', 'E', 'Q', 'A', 'R', 'R', 'A', 'Y'};
+const uint32_t SequenceFileVersion = 1;
+const uint32_t SequenceFileByteOrder = 0x01020304;
+
+inline uint64_t SequenceFileChecksum(const void* bytes, size_t length, uint64_t hash = 14695981039346656037ull) {
+    const unsigned char* current = static_cast<const unsigned char*>(bytes);
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ current[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// ArraySequence over a file written by Save. The file is mapped rather than
+// read, so opening costs O(1) whatever its size, and reads go straight to
+// the mapping. By default the mapping is read-only and the first write
+// copies the elements to the heap; with privateWrites it is mapped
+// copy-on-write, so writes through operator[] stay in place and only touch
+// the pages they hit (never the file). Structural changes always move the
+// elements to the heap. Without mmap (Windows) the file is read instead.
+template <class T>
+class MappedArraySequence : public ArraySequence<T> {
+    static_assert(is_trivially_copyable<T>::value, "MappedArraySequence needs a trivially copyable T");
+
+private:
+    // Second owner of a read-only mapping, so that writes unshare it first.
+    shared_ptr<T> mapping;
+    uint64_t checksum;
+
+    static uint32_t Alignment() {
+        return static_cast<uint32_t>(max<size_t>(64, alignof(T)));
+    }
+
+    static void Validate(const SequenceFileHeader& header, uint64_t fileSize) {
+        if (memcmp(header.magic, SequenceFileMagic, sizeof(SequenceFileMagic)) != 0
+            || header.version != SequenceFileVersion || header.byteOrder != SequenceFileByteOrder) {
+            throw SequenceFileError("Not a sequence file");
+        }
+        if (header.elementSize != sizeof(T) || header.dataOffset % alignof(T) != 0) {
+            throw SequenceFileError("Sequence file element type mismatch");
+        }
+        if (header.dataOffset < sizeof(header)) {
+            throw SequenceFileError("Sequence file header is corrupt");
+        }
+        // Written so that nothing wraps: count is bounded first, and the
+        // element bytes are compared with what follows the offset.
+        if (header.count > static_cast<uint64_t>(INT_MAX) || header.dataOffset > fileSize
+            || header.count * header.elementSize > fileSize - header.dataOffset) {
+            throw SequenceFileError("Sequence file is truncated");
+        }
+    }
+
+public:
+    explicit MappedArraySequence(const char* path, bool privateWrites = false) {
+#ifndef _WIN32
+        int file = open(path, O_RDONLY);
+        if (file < 0) {
+            throw SequenceFileError("Cannot open sequence file");
+        }
+        struct stat status;
+        if (fstat(file, &status) != 0 || static_cast<uint64_t>(status.st_size) < sizeof(SequenceFileHeader)) {
+            close(file);
+            throw SequenceFileError("Sequence file is truncated");
+        }
+        size_t length = static_cast<size_t>(status.st_size);
+        void* base = mmap(nullptr, length, privateWrites ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, file, 0);
+        close(file);
+        if (base == MAP_FAILED) {
+            throw SequenceFileError("Cannot map sequence file");
+        }
+        SequenceFileHeader header;
+        memcpy(&header, base, sizeof(header));
+        try {
+            Validate(header, length);
+        }
+        catch (...) {
+            munmap(base, length);
+            throw;
+        }
+        shared_ptr<T> buffer(reinterpret_cast<T*>(static_cast<char*>(base) + header.dataOffset), [base, length](T*) {
+            munmap(base, length);
+        });
+        if (!privateWrites) {
+            mapping = buffer;
+        }
+#else
+        (void)privateWrites;
+        ifstream file(path, ios::binary | ios::ate);
+        if (!file) {
+            throw SequenceFileError("Cannot open sequence file");
+        }
+        uint64_t length = static_cast<uint64_t>(file.tellg());
+        SequenceFileHeader header;
+        file.seekg(0);
+        if (length < sizeof(header) || !file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            throw SequenceFileError("Sequence file is truncated");
+        }
+        Validate(header, length);
+        shared_ptr<T> buffer(new T[header.count > 0 ? header.count : 1], default_delete<T[]>());
+        file.seekg(static_cast<streamoff>(header.dataOffset));
+        file.read(reinterpret_cast<char*>(buffer.get()), static_cast<streamsize>(header.count * sizeof(T)));
+#endif
+        checksum = header.checksum;
+        delete this->array;
+        this->array = new DynamicArray<T>(buffer, static_cast<int>(header.count));
+    }
+
+    MappedArraySequence(const MappedArraySequence<T>& other)
+        : ArraySequence<T>(other), mapping(other.mapping), checksum(other.checksum) {}
+
+    // O(n): compares the current elements with the checksum in the file.
+    bool VerifyChecksum() const {
+        const DynamicArray<T>& items = *this->array;
+        return SequenceFileChecksum(items.GetData(), items.GetSize() * sizeof(T)) == checksum;
+    }
+
+    // Writes sequence in the format above, streaming it in chunks.
+    static bool Save(const char* path, const Sequence<T>& sequence) {
+        SequenceFileHeader header;
+        memcpy(header.magic, SequenceFileMagic, sizeof(SequenceFileMagic));
+        header.version = SequenceFileVersion;
+        header.byteOrder = SequenceFileByteOrder;
+        header.elementSize = sizeof(T);
+        header.alignment = Alignment();
+        header.count = static_cast<uint64_t>(sequence.GetSize());
+        header.dataOffset = (sizeof(header) + Alignment() - 1) / Alignment() * Alignment();
+        header.checksum = 0;
+
+        ofstream file(path, ios::binary | ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (uint64_t i = sizeof(header); i < header.dataOffset; ++i) {
+            file.put(0);
+        }
+
+        const int chunkSize = 1 << 14;
+        DynamicArray<T> chunk(chunkSize);
+        T* buffer = chunk.GetData();
+        int used = 0;
+        auto flush = [&]() {
+            file.write(reinterpret_cast<const char*>(buffer), static_cast<streamsize>(used * sizeof(T)));
+            header.checksum = SequenceFileChecksum(buffer, used * sizeof(T), header.checksum);
+            used = 0;
+        };
+        header.checksum = SequenceFileChecksum(nullptr, 0);
+        sequence.Visit([&](const T& item) {
+            buffer[used++] = item;
+            if (used == chunkSize) {
+                flush();
+            }
+        });
+        flush();
+
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        return static_cast<bool>(file);
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new MappedArraySequence<T>(*this);
+    }
+};
+
+#ifndef _WIN32
+// Control block at the start of a shared sequence object. Appends publish
+// the new length; in-place writes make epoch odd while they run, so readers
+// retry instead of returning a half-written element.
+struct SharedSequenceHeader {
+    char magic[8];
+    uint32_t elementSize;
+    int capacity;
+    uint64_t dataOffset;
+    atomic<uint64_t> epoch;
+    atomic<int> length;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+    "SharedArraySequence needs lock-free atomics to share them between processes");
+
+const char SharedSequenceMagic[8] = {'S', 'E', 'Q', 'S', 'H', 'A', 'R', 'E'};
+
+// Array in POSIX shared memory, so that processes on one host read the same
+// elements instead of keeping a copy each. The process that creates it (with
+// a capacity) is the only writer and removes the name when it is destroyed;
+// the others attach by name read-only and may mutate nothing. Capacity is
+// fixed at creation. Get and the other by-value reads are consistent with
+// Set, Prepend and Insert; references from operator[] are not, and writes
+// through the writer's operator[] are not published to readers' epoch.
+// Clone and the derived sequences are private ArraySequence copies.
+template <class T>
+class SharedArraySequence : public Sequence<T> {
+    static_assert(is_trivially_copyable<T>::value, "SharedArraySequence needs a trivially copyable T");
+
+private:
+    shared_ptr<SharedSequenceHeader> header;
+    T* data;
+    bool writer;
+
+    static uint64_t DataOffset() {
+        return max<uint64_t>(64, alignof(T));
+    }
+
+    static shared_ptr<SharedSequenceHeader> Map(int file, size_t length, bool writable, const string& owned) {
+        void* base = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+        close(file);
+        if (base == MAP_FAILED) {
+            if (!owned.empty()) {
+                shm_unlink(owned.c_str());
+            }
+            throw SequenceFileError("Cannot map shared sequence");
+        }
+        return shared_ptr<SharedSequenceHeader>(static_cast<SharedSequenceHeader*>(base),
+            [length, owned](SharedSequenceHeader* base) {
+                munmap(base, length);
+                if (!owned.empty()) {
+                    shm_unlink(owned.c_str());
+                }
+            });
+    }
+
+    void CheckWriter() const {
+        if (!writer) {
+            throw SequenceFileError("Shared sequence is read-only here");
+        }
+    }
+
+    int Reserve() const {
+        CheckWriter();
+        int length = header->length.load(memory_order_relaxed);
+        if (length == header->capacity) {
+            throw SequenceFileError("Shared sequence is full");
+        }
+        return length;
+    }
+
+    // Brackets an in-place change for readers: epoch is odd while it runs.
+    template <class Change>
+    void Publish(Change change) {
+        header->epoch.fetch_add(1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        change();
+        header->epoch.fetch_add(1, memory_order_release);
+    }
+
+    T Read(int index) const {
+        T value;
+        if (writer) {
+            memcpy(&value, data + index, sizeof(T));
+            return value;
+        }
+        for (;;) {
+            uint64_t before = header->epoch.load(memory_order_acquire);
+            memcpy(&value, data + index, sizeof(T));
+            atomic_thread_fence(memory_order_acquire);
+            if ((before & 1) == 0 && header->epoch.load(memory_order_relaxed) == before) {
+                return value;
+            }
+            this_thread::yield();
+        }
+    }
+
+    ArraySequence<T>* Snapshot(int startIndex, int endIndex) const {
+        ArraySequence<T>* result = new ArraySequence<T>();
+        for (int i = startIndex; i < endIndex; ++i) {
+            result->Append(Read(i));
+        }
+        return result;
+    }
+
+public:
+    // Creates the shared object name with room for capacity elements; this
+    // process becomes its writer. An existing object may still have a live
+    // writer, so it is an error unless replaceStale says the caller knows
+    // it was left behind; readers attached to it keep the old copy.
+    SharedArraySequence(const char* name, int capacity, bool replaceStale = false) : writer(true) {
+        if (capacity < 0) throw IndexOutOfRange();
+        if (replaceStale) {
+            shm_unlink(name);
+        }
+        int file = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (file < 0) {
+            if (errno == EEXIST) {
+                throw SequenceFileError("Shared sequence already exists");
+            }
+            throw SequenceFileError("Cannot create shared sequence");
+        }
+        size_t length = static_cast<size_t>(DataOffset() + static_cast<uint64_t>(capacity) * sizeof(T));
+        if (ftruncate(file, static_cast<off_t>(length)) != 0) {
+            close(file);
+            shm_unlink(name);
+            throw SequenceFileError("Cannot create shared sequence");
+        }
+        header = Map(file, length, true, name);
+        new (header.get()) SharedSequenceHeader();
+        header->elementSize = sizeof(T);
+        header->capacity = capacity;
+        header->dataOffset = DataOffset();
+        header->epoch.store(0, memory_order_relaxed);
+        header->length.store(0, memory_order_relaxed);
+        data = reinterpret_cast<T*>(reinterpret_cast<char*>(header.get()) + DataOffset());
+        // The magic goes last, so readers never attach to a half-made header.
+        atomic_thread_fence(memory_order_release);
+        memcpy(header->magic, SharedSequenceMagic, sizeof(SharedSequenceMagic));
+    }
+
+    // Attaches read-only to a sequence created by another process.
+    explicit SharedArraySequence(const char* name) : writer(false) {
+        int file = shm_open(name, O_RDONLY, 0);
+        if (file < 0) {
+            throw SequenceFileError("Cannot open shared sequence");
+        }
+        struct stat status;
+        if (fstat(file, &status) != 0 || static_cast<uint64_t>(status.st_size) < DataOffset()) {
+            close(file);
+            throw SequenceFileError("Shared sequence is truncated");
+        }
+        size_t length = static_cast<size_t>(status.st_size);
+        header = Map(file, length, false, string());
+        if (memcmp(header->magic, SharedSequenceMagic, sizeof(SharedSequenceMagic)) != 0) {
+            throw SequenceFileError("Not a shared sequence");
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (header->elementSize != sizeof(T) || header->dataOffset != DataOffset()) {
+            throw SequenceFileError("Shared sequence element type mismatch");
+        }
+        if (header->dataOffset + static_cast<uint64_t>(header->capacity) * sizeof(T) > length) {
+            throw SequenceFileError("Shared sequence is truncated");
+        }
+        data = reinterpret_cast<T*>(reinterpret_cast<char*>(header.get()) + DataOffset());
+    }
+
+    SharedArraySequence(const SharedArraySequence<T>&) = delete;
+    SharedArraySequence<T>& operator=(const SharedArraySequence<T>&) = delete;
+
+    bool IsWriter() const {
+        return writer;
+    }
+
+    int GetCapacity() const {
+        return header->capacity;
+    }
+
+    // Changes on every Set, Prepend and Insert; appends only raise the size.
+    uint64_t GetEpoch() const {
+        return header->epoch.load(memory_order_acquire);
+    }
+
+    void Set(int index, const T& item) {
+        CheckWriter();
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        Publish([&]() {
+            data[index] = item;
+        });
+    }
+
+    T GetFirst() override {
+        if (GetSize() == 0) throw IndexOutOfRange();
+        return Read(0);
+    }
+
+    T GetLast() override {
+        int size = GetSize();
+        if (size == 0) throw IndexOutOfRange();
+        return Read(size - 1);
+    }
+
+    T Get(int index) const override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return Read(index);
+    }
+
+    int GetSize() const override {
+        return header->length.load(memory_order_acquire);
+    }
+
+    void Append(T item) override {
+        int length = Reserve();
+        data[length] = item;
+        header->length.store(length + 1, memory_order_release);
+    }
+
+    void Prepend(T item) override {
+        Insert(item, 0);
+    }
+
+    void Insert(T item, int index) override {
+        int length = Reserve();
+        if (index < 0 || index > length) throw IndexOutOfRange();
+        if (index == length) {
+            Append(item);
+            return;
+        }
+        Publish([&]() {
+            memmove(data + index + 1, data + index, (length - index) * sizeof(T));
+            data[index] = item;
+            header->length.store(length + 1, memory_order_relaxed);
+        });
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= GetSize() || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        return Snapshot(startIndex, endIndex + 1);
+    }
+
+    Sequence<T>* Concat(Sequence<T>* list) override {
+        ArraySequence<T>* result = Snapshot(0, GetSize());
+        for (int i = 0; i < list->GetSize(); ++i) {
+            result->Append(list->Get(i));
+        }
+        return result;
+    }
+
+    Sequence<T>* Map(function<T(T)> func) override {
+        ArraySequence<T>* result = new ArraySequence<T>();
+        int size = GetSize();
+        for (int i = 0; i < size; ++i) {
+            result->Append(func(Read(i)));
+        }
+        return result;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override {
+        ArraySequence<T>* result = new ArraySequence<T>();
+        for (int i = 0; i < other.GetSize(); ++i) {
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    Sequence<T>* Zip(const Sequence<T>& other) const override {
+        ArraySequence<T>* result = new ArraySequence<T>();
+        int minSize = min(GetSize(), other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(Read(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    bool TryGet(int index, T& value) override {
+        if (index < 0 || index >= GetSize()) {
+            return false;
+        }
+        value = Read(index);
+        return true;
+    }
+
+    bool TryFind(function<bool(T)> predicate, T& value) override {
+        int size = GetSize();
+        for (int i = 0; i < size; ++i) {
+            T item = Read(i);
+            if (predicate(item)) {
+                value = item;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    T& operator[](int index) override {
+        CheckWriter();
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return data[index];
+    }
+
+    const T& operator[](int index) const override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return data[index];
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return Snapshot(0, GetSize());
+    }
+
+protected:
+    void SortItems(const typename Sequence<T>::Comparator& less, bool stable) override {
+        CheckWriter();
+        int size = GetSize();
+        Publish([&]() {
+            SortBuffer(data, size, less, stable);
+        });
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        int size = GetSize();
+        for (int i = 0; i < size; ++i) {
+            visitor(Read(i));
+        }
+    }
+};
+#endif
+
+// Streaming loader for numeric text: numbers separated by commas, blanks or
+// line breaks are parsed in place from large chunks and appended straight
+// to the target (any sequence, DynamicArray or SegmentedList), with no
+// per-token strings. A malformed token stops the load and is reported
+// through invalid; the numbers before it stay appended.
+const int MaxNumberLength = 256;
+
+inline bool IsNumberDelimiter(char symbol) {
+    return symbol == ',' || symbol == ' ' || symbol == '\n' || symbol == '\r' || symbol == '\t';
+}
+
+template <class T>
+bool ParseNumber(const char* current, const char* end, T& value, true_type) {
+    typedef typename make_unsigned<T>::type Unsigned;
+    bool negative = current != end && *current == '-';
+    if (current != end && (*current == '-' || *current == '+')) {
+        ++current;
+    }
+    if (current == end) {
+        return false;
+    }
+    Unsigned limit = static_cast<Unsigned>(numeric_limits<T>::max());
+    if (negative) {
+        limit = is_signed<T>::value ? limit + 1 : 0;
+    }
+    Unsigned result = 0;
+    for (; current != end; ++current) {
+        unsigned digit = static_cast<unsigned>(*current - '0');
+        if (digit > 9 || digit > limit || result > (limit - digit) / 10) {
+            return false;
+        }
+        result = static_cast<Unsigned>(result * 10 + digit);
+    }
+    value = static_cast<T>(negative ? 0 - result : result);
+    return true;
+}
+
+// Up to 19 significant digits and a power of ten up to 22 convert exactly
+// through double; anything else goes to the (locale-independent) stream.
+template <class T>
+bool ParseNumber(const char* begin, const char* end, T& value, false_type) {
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char* current = begin;
+    bool negative = current != end && *current == '-';
+    if (current != end && (*current == '-' || *current == '+')) {
+        ++current;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int mantissaDigits = 0;
+    int exponent = 0;
+    bool fraction = false;
+    for (; current != end; ++current) {
+        if (*current == '.' && !fraction) {
+            fraction = true;
+            continue;
+        }
+        unsigned digit = static_cast<unsigned>(*current - '0');
+        if (digit > 9) {
+            break;
+        }
+        ++mantissaDigits;
+        if (mantissa == 0 && digit == 0) {
+            exponent -= fraction ? 1 : 0;
+            continue;
+        }
+        if (digits < 19) {
+            mantissa = mantissa * 10 + digit;
+            ++digits;
+            exponent -= fraction ? 1 : 0;
+        }
+        else {
+            digits = 20;
+            exponent += fraction ? 0 : 1;
+        }
+    }
+    if (mantissaDigits == 0) {
+        return false;
+    }
+    if (current != end && (*current == 'e' || *current == 'E')) {
+        ++current;
+        bool negativeExponent = current != end && *current == '-';
+        if (current != end && (*current == '-' || *current == '+')) {
+            ++current;
+        }
+        if (current == end) {
+            return false;
+        }
+        int power = 0;
+        for (; current != end; ++current) {
+            unsigned digit = static_cast<unsigned>(*current - '0');
+            if (digit > 9) {
+                return false;
+            }
+            power = min(power * 10 + static_cast<int>(digit), 100000);
+        }
+        exponent += negativeExponent ? -power : power;
+    }
+    if (current != end) {
+        return false;
+    }
+    if (digits <= 19 && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+        double result = static_cast<double>(mantissa);
+        result = exponent < 0 ? result / powers[-exponent] : result * powers[exponent];
+        value = static_cast<T>(negative ? -result : result);
+        return true;
+    }
+    istringstream stream(string(begin, end));
+    stream.imbue(locale::classic());
+    stream >> value;
+    return !stream.fail() && stream.peek() == char_traits<char>::eof();
+}
+
+// Parses the numbers in [current, end). Unless final, a token running into
+// end may continue in the next chunk, so it is left unparsed; returns where
+// parsing stopped, or nullptr on a malformed token.
+template <class T, class Target>
+const char* ParseNumbers(const char* current, const char* end, bool final, Target& target, string* invalid) {
+    static_assert(is_arithmetic<T>::value && !is_same<T, bool>::value, "ParseNumbers needs a numeric T");
+    for (;;) {
+        while (current != end && IsNumberDelimiter(*current)) {
+            ++current;
+        }
+        const char* token = current;
+        while (current != end && !IsNumberDelimiter(*current)) {
+            ++current;
+        }
+        if (token == end || (current == end && !final)) {
+            return token;
+        }
+        T value;
+        if (!ParseNumber(token, current, value, is_integral<T>())) {
+            if (invalid) {
+                invalid->assign(token, current);
+            }
+            return nullptr;
+        }
+        target.Append(value);
+    }
+}
+
+template <class T, class Target>
+bool ParseNumbers(const char* text, size_t length, Target& target, string* invalid = nullptr) {
+    return ParseNumbers<T>(text, text + length, true, target, invalid) != nullptr;
+}
+
+template <class Target>
+auto ReserveItems(Target& target, double count, int) -> decltype(target.Reserve(0), void()) {
+    target.Reserve(static_cast<int>(min(count, static_cast<double>(INT_MAX))));
+}
+
+template <class Target>
+void ReserveItems(Target&, double, long) {}
+
+// When the stream can tell its length, the target is reserved after the
+// first chunk from the number density seen so far.
+template <class T, class Target>
+bool LoadNumbers(istream& input, Target& target, string* invalid = nullptr) {
+    const int chunkSize = 1 << 16;
+    unique_ptr<char[]> buffer(new char[chunkSize + MaxNumberLength]);
+    streamoff total = -1;
+    streampos start = input.tellg();
+    if (start != streampos(-1) && input.seekg(0, ios::end)) {
+        total = input.tellg() - start;
+        input.seekg(start);
+    }
+    input.clear();
+    int initialSize = target.GetSize();
+    bool reserved = false;
+    streamoff consumed = 0;
+    int carried = 0;
+    for (;;) {
+        input.read(buffer.get() + carried, chunkSize);
+        int length = carried + static_cast<int>(input.gcount());
+        bool final = input.gcount() < chunkSize;
+        const char* end = buffer.get() + length;
+        const char* stop = ParseNumbers<T>(buffer.get(), end, final, target, invalid);
+        if (!stop) {
+            return false;
+        }
+        carried = static_cast<int>(end - stop);
+        if (carried > MaxNumberLength) {
+            if (invalid) {
+                invalid->assign(stop, MaxNumberLength);
+            }
+            return false;
+        }
+        consumed += length - carried;
+        if (!reserved && total > consumed && consumed > 0) {
+            double parsed = target.GetSize() - initialSize;
+            ReserveItems(target, initialSize + parsed * total / consumed * 1.02, 0);
+            reserved = true;
+        }
+        if (final) {
+            return !input.bad();
+        }
+        memmove(buffer.get(), stop, carried);
+    }
+}
+
+template <class T, class Target>
+bool LoadNumbers(const char* path, Target& target, string* invalid = nullptr) {
+    ifstream file(path, ios::binary);
+    return file && LoadNumbers<T>(file, target, invalid);
+}
+
+// Binary form of a sequence: this header, then the payload. Raw payloads
+// hold the elements as stored in memory (native byte order, starting 8-byte
+// aligned within the buffer); delta payloads hold, for integral T, the
+// zigzag varint of each difference from the previous element, which keeps
+// sorted and slowly changing data to a byte or two per element.
+struct SerializedHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t encoding;
+    uint16_t reserved;
+    uint32_t elementSize;
+    uint32_t byteOrder;
+    uint64_t count;
+};
+
+enum SerializedEncoding {
+    RawEncoding = 0,
+    DeltaEncoding = 1
+};
+
+const char SerializedMagic[4] = {'S', 'E', 'Q', 'B'};
+const uint8_t SerializedVersion = 1;
+
+template <class T>
+struct DeltaEncodable {
+    static const bool value = is_integral<T>::value && !is_same<T, bool>::value && sizeof(T) <= sizeof(uint64_t);
+};
+
+inline uint64_t ZigZag(uint64_t delta) {
+    return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+inline uint64_t UnZigZag(uint64_t value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+inline int VarintLength(uint64_t value) {
+    int length = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++length;
+    }
+    return length;
+}
+
+inline char* WriteVarint(char* output, uint64_t value) {
+    while (value >= 0x80) {
+        *output++ = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    *output++ = static_cast<char>(value);
+    return output;
+}
+
+inline const char* ReadVarint(const char* current, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; current != end && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*current++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return current;
+        }
+    }
+    return nullptr;
+}
+
+template <class T>
+uint64_t ToBits(const T& value) {
+    return static_cast<uint64_t>(static_cast<typename conditional<is_signed<T>::value, int64_t, uint64_t>::type>(value));
+}
+
+template <class T>
+uint64_t DeltaPayloadSize(const Sequence<T>& sequence, true_type) {
+    uint64_t size = 0;
+    uint64_t previous = 0;
+    sequence.Visit([&](const T& item) {
+        size += VarintLength(ZigZag(ToBits(item) - previous));
+        previous = ToBits(item);
+    });
+    return size;
+}
+
+template <class T>
+uint64_t DeltaPayloadSize(const Sequence<T>&, false_type) {
+    return UINT64_MAX;
+}
+
+template <class T, class Write>
+void WriteDeltaPayload(const Sequence<T>& sequence, Write& write, true_type) {
+    const int chunkSize = 1 << 16;
+    unique_ptr<char[]> chunk(new char[chunkSize + 10]);
+    char* buffer = chunk.get();
+    char* current = buffer;
+    uint64_t previous = 0;
+    sequence.Visit([&](const T& item) {
+        current = WriteVarint(current, ZigZag(ToBits(item) - previous));
+        previous = ToBits(item);
+        if (current - buffer >= chunkSize) {
+            write(buffer, current - buffer);
+            current = buffer;
+        }
+    });
+    write(buffer, current - buffer);
+}
+
+template <class T, class Write>
+void WriteDeltaPayload(const Sequence<T>&, Write&, false_type) {}
+
+template <class T, class Write>
+void WriteRawPayload(const Sequence<T>& sequence, Write& write) {
+    const int chunkSize = max(1, (1 << 16) / static_cast<int>(sizeof(T)));
+    DynamicArray<T> chunk(chunkSize);
+    T* buffer = chunk.GetData();
+    int used = 0;
+    sequence.Visit([&](const T& item) {
+        buffer[used++] = item;
+        if (used == chunkSize) {
+            write(reinterpret_cast<const char*>(buffer), used * sizeof(T));
+            used = 0;
+        }
+    });
+    write(reinterpret_cast<const char*>(buffer), used * sizeof(T));
+}
+
+// Writes sequence through write(bytes, length), picking the delta encoding
+// for integers whenever it comes out smaller than the raw one.
+template <class T, class Write>
+void SerializeTo(const Sequence<T>& sequence, Write write) {
+    static_assert(is_trivially_copyable<T>::value, "Serialize needs a trivially copyable T");
+    SerializedHeader header;
+    memcpy(header.magic, SerializedMagic, sizeof(SerializedMagic));
+    header.version = SerializedVersion;
+    header.reserved = 0;
+    header.elementSize = sizeof(T);
+    header.byteOrder = SequenceFileByteOrder;
+    header.count = static_cast<uint64_t>(sequence.GetSize());
+    uint64_t deltaSize = DeltaPayloadSize(sequence, integral_constant<bool, DeltaEncodable<T>::value>());
+    header.encoding = deltaSize < header.count * sizeof(T) ? DeltaEncoding : RawEncoding;
+    write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (header.encoding == DeltaEncoding) {
+        WriteDeltaPayload(sequence, write, integral_constant<bool, DeltaEncodable<T>::value>());
+    }
+    else {
+        WriteRawPayload(sequence, write);
+    }
+}
+
+template <class T>
+string Serialize(const Sequence<T>& sequence) {
+    string result;
+    SerializeTo(sequence, [&](const char* bytes, size_t length) {
+        result.append(bytes, length);
+    });
+    return result;
+}
+
+template <class T>
+bool Serialize(const Sequence<T>& sequence, ostream& output) {
+    SerializeTo(sequence, [&](const char* bytes, size_t length) {
+        output.write(bytes, static_cast<streamsize>(length));
+    });
+    return static_cast<bool>(output);
+}
+
+// Checks the header against T and the buffer length; returns the payload.
+template <class T>
+const char* ReadSerializedHeader(const char* data, size_t length, SerializedHeader& header) {
+    if (length < sizeof(header)) {
+        return nullptr;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SerializedMagic, sizeof(SerializedMagic)) != 0 || header.version != SerializedVersion
+        || header.elementSize != sizeof(T) || header.byteOrder != SequenceFileByteOrder
+        || header.count > static_cast<uint64_t>(INT_MAX)) {
+        return nullptr;
+    }
+    uint64_t payload = length - sizeof(header);
+    if (header.encoding == RawEncoding ? payload != header.count * sizeof(T)
+        : header.encoding != DeltaEncoding || !DeltaEncodable<T>::value || payload < header.count) {
+        return nullptr;
+    }
+    return data + sizeof(header);
+}
+
+template <class T, class Target>
+bool ReadDeltaPayload(const char* current, const char* end, uint64_t count, Target& target, true_type) {
+    uint64_t previous = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t delta;
+        current = ReadVarint(current, end, delta);
+        if (!current) {
+            return false;
+        }
+        previous += UnZigZag(delta);
+        target.Append(static_cast<T>(previous));
+    }
+    return current == end;
+}
+
+template <class T, class Target>
+bool ReadDeltaPayload(const char*, const char*, uint64_t, Target&, false_type) {
+    return false;
+}
+
+// Appends the elements serialized in data to target (any sequence or
+// DynamicArray); returns false, leaving target untouched, on a buffer that
+// is not a serialized sequence of T, or as many elements as were decoded
+// before a corrupt delta payload.
+template <class T, class Target>
+bool Deserialize(const char* data, size_t length, Target& target) {
+    static_assert(is_trivially_copyable<T>::value, "Deserialize needs a trivially copyable T");
+    SerializedHeader header;
+    const char* payload = ReadSerializedHeader<T>(data, length, header);
+    if (!payload) {
+        return false;
+    }
+    ReserveItems(target, static_cast<double>(target.GetSize()) + header.count, 0);
+    if (header.encoding == DeltaEncoding) {
+        return ReadDeltaPayload<T>(payload, data + length, header.count, target,
+            integral_constant<bool, DeltaEncodable<T>::value>());
+    }
+    for (uint64_t i = 0; i < header.count; ++i) {
+        T item;
+        memcpy(&item, payload + i * sizeof(T), sizeof(T));
+        target.Append(item);
+    }
+    return true;
+}
+
+template <class T, class Target>
+bool Deserialize(const string& data, Target& target) {
+    return Deserialize<T>(data.data(), data.size(), target);
+}
+
+template <class T, class Target>
+bool Deserialize(istream& input, Target& target) {
+    string data((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+    return !input.bad() && Deserialize<T>(data, target);
+}
+
+// Read-only view of a raw serialized sequence that reads the elements in
+// place from the buffer, which must outlive the view. Delta payloads have
+// no fixed-width layout and are refused; use Deserialize for those.
+template <class T>
+class SerializedView {
+private:
+    const char* items;
+    int count;
+
+public:
+    SerializedView(const char* data, size_t length) {
+        SerializedHeader header;
+        items = ReadSerializedHeader<T>(data, length, header);
+        if (!items) {
+            throw SequenceFileError("Not a serialized sequence of this type");
+        }
+        if (header.encoding != RawEncoding) {
+            throw SequenceFileError("Serialized sequence is not fixed-width");
+        }
+        count = static_cast<int>(header.count);
+    }
+
+    int GetSize() const {
+        return count;
+    }
+
+    T Get(int index) const {
+        if (index < 0 || index >= count) {
+            throw IndexOutOfRange();
+        }
+        T item;
+        memcpy(&item, items + static_cast<size_t>(index) * sizeof(T), sizeof(T));
+        return item;
+    }
+
+    // The elements themselves when the buffer is aligned for T, else nullptr.
+    const T* GetData() const {
+        return reinterpret_cast<uintptr_t>(items) % alignof(T) == 0 ? reinterpret_cast<const T*>(items) : nullptr;
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        for (int i = 0; i < count; ++i) {
+            func(Get(i));
+        }
+    }
+};
+
+// Sequence of trivially copyable T kept in fixed pages, at most
+// memoryBudget bytes of which stay in memory; the rest are written to an
+// unnamed temporary file. Resident pages form a CLOCK cache: a miss evicts
+// the first frame not used since the hand last passed it, writing it back
+// only if it changed, and misses on consecutive pages read the next ones
+// ahead. Like SegmentedList, inserts split a full page. References from
+// operator[] stay valid only until another page is touched, and reads
+// update the cache, so even const use is single-threaded.
+template <class T, int PageBytes = 64 * 1024>
+class SpillingSequence : public Sequence<T> {
+    static_assert(is_trivially_copyable<T>::value, "SpillingSequence needs a trivially copyable T");
+
+private:
+    enum { PageItems = PageBytes / static_cast<int>(sizeof(T)) > 1 ? PageBytes / static_cast<int>(sizeof(T)) : 1 };
+    enum { ReadAhead = 4 };
+
+    struct Page {
+        int count;
+        int slot;
+        int frame;
+    };
+
+    struct Frame {
+        shared_ptr<T> items;
+        int page;
+        bool dirty;
+        bool referenced;
+    };
+
+    size_t memoryBudget;
+    int frameLimit;
+    int size;
+    // The cache state, including where each page lives, changes on reads.
+    mutable DynamicArray<Page> pages;
+    mutable DynamicArray<Frame> frames;
+    // Fenwick tree over the page counts, so any index is found in
+    // O(log pages); entry i - 1 sums the counts of pages (i - (i & -i), i].
+    DynamicArray<int> pageSums;
+    mutable int hand;
+    mutable int lastMiss;
+    mutable int lastPage;
+    mutable int lastStart;
+    mutable FILE* file;
+    mutable int slotCount;
+
+    FILE* SpillFile() const {
+        if (!file) {
+            file = tmpfile();
+            if (!file) {
+                throw SequenceFileError("Cannot create spill file");
+            }
+        }
+        return file;
+    }
+
+    static bool Seek(FILE* spill, int slot) {
+        long long offset = static_cast<long long>(slot) * PageItems * sizeof(T);
+#ifdef _WIN32
+        return _fseeki64(spill, offset, SEEK_SET) == 0;
+#else
+        return fseeko(spill, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+    }
+
+    void WriteBack(Frame& frame) const {
+        if (!frame.dirty) {
+            return;
+        }
+        Page& page = pages.AtUnchecked(frame.page);
+        if (page.slot < 0) {
+            page.slot = slotCount++;
+        }
+        FILE* spill = SpillFile();
+        if (!Seek(spill, page.slot) || fwrite(frame.items.get(), sizeof(T), PageItems, spill) != PageItems) {
+            throw SequenceFileError("Cannot write spill file");
+        }
+        frame.dirty = false;
+    }
+
+    // A free frame, evicting one once the budget is used up; the frame
+    // holding page keep is never chosen.
+    int TakeFrame(int keep) const {
+        if (frames.GetSize() < frameLimit) {
+            Frame frame;
+            frame.items = shared_ptr<T>(new T[PageItems], default_delete<T[]>());
+            frame.page = -1;
+            frame.dirty = false;
+            frame.referenced = false;
+            frames.Append(frame);
+            return frames.GetSize() - 1;
+        }
+        for (;;) {
+            int current = hand;
+            hand = (hand + 1) % frames.GetSize();
+            Frame& frame = frames.AtUnchecked(current);
+            if (frame.page == keep) {
+                continue;
+            }
+            if (frame.referenced) {
+                frame.referenced = false;
+                continue;
+            }
+            WriteBack(frame);
+            pages.AtUnchecked(frame.page).frame = -1;
+            frame.page = -1;
+            return current;
+        }
+    }
+
+    void Fill(int pageIndex, int frameIndex, bool referenced) const {
+        Frame& frame = frames.AtUnchecked(frameIndex);
+        Page& page = pages.AtUnchecked(pageIndex);
+        FILE* spill = SpillFile();
+        if (!Seek(spill, page.slot) || fread(frame.items.get(), sizeof(T), PageItems, spill) != PageItems) {
+            throw SequenceFileError("Cannot read spill file");
+        }
+        frame.page = pageIndex;
+        frame.dirty = false;
+        frame.referenced = referenced;
+        page.frame = frameIndex;
+    }
+
+    T* Load(int pageIndex) const {
+        if (pages.AtUnchecked(pageIndex).frame < 0) {
+            Fill(pageIndex, TakeFrame(-1), true);
+            int last = pageIndex;
+            if (pageIndex == lastMiss + 1) {
+                int ahead = min<int>(ReadAhead, frameLimit / 2);
+                for (int next = pageIndex + 1; next <= pageIndex + ahead && next < pages.GetSize(); ++next) {
+                    if (pages.AtUnchecked(next).frame < 0) {
+                        Fill(next, TakeFrame(pageIndex), false);
+                    }
+                    last = next;
+                }
+            }
+            lastMiss = last;
+        }
+        Frame& frame = frames.AtUnchecked(pages.AtUnchecked(pageIndex).frame);
+        frame.referenced = true;
+        return frame.items.get();
+    }
+
+    void Touch(int pageIndex) {
+        frames.AtUnchecked(pages.AtUnchecked(pageIndex).frame).dirty = true;
+    }
+
+    // Number of items on the pages before pageIndex.
+    int ItemsBefore(int pageIndex) const {
+        int sum = 0;
+        for (int i = pageIndex; i > 0; i -= i & -i) {
+            sum += pageSums.AtUnchecked(i - 1);
+        }
+        return sum;
+    }
+
+    void AddItems(int pageIndex, int delta) {
+        pages.AtUnchecked(pageIndex).count += delta;
+        for (int i = pageIndex + 1; i <= pageSums.GetSize(); i += i & -i) {
+            pageSums.AtUnchecked(i - 1) += delta;
+        }
+    }
+
+    void RebuildPageSums() {
+        int count = pages.GetSize();
+        pageSums = DynamicArray<int>(count);
+        for (int i = 0; i < count; ++i) {
+            pageSums.AtUnchecked(i) = pages.AtUnchecked(i).count;
+        }
+        for (int i = 1; i <= count; ++i) {
+            int parent = i + (i & -i);
+            if (parent <= count) {
+                pageSums.AtUnchecked(parent - 1) += pageSums.AtUnchecked(i - 1);
+            }
+        }
+    }
+
+    // The page holding index, found by descending the Fenwick tree; start
+    // receives the index of its first item.
+    int FindPage(int index, int& start) const {
+        int count = pageSums.GetSize();
+        int step = 1;
+        while (step <= count / 2) {
+            step *= 2;
+        }
+        int pageIndex = 0;
+        start = 0;
+        for (; step > 0; step /= 2) {
+            int next = pageIndex + step;
+            if (next <= count && start + pageSums.AtUnchecked(next - 1) <= index) {
+                pageIndex = next;
+                start += pageSums.AtUnchecked(next - 1);
+            }
+        }
+        return pageIndex;
+    }
+
+    // Sequential access stays on the remembered page or steps to the next
+    // one; any other jump goes through the Fenwick tree.
+    int Locate(int index, int& position) const {
+        int end = lastStart + pages.AtUnchecked(lastPage).count;
+        if (index < lastStart || index >= end) {
+            if (index >= end && lastPage + 1 < pages.GetSize() && index < end + pages.AtUnchecked(lastPage + 1).count) {
+                lastPage++;
+                lastStart = end;
+            }
+            else {
+                lastPage = FindPage(index, lastStart);
+            }
+        }
+        position = index - lastStart;
+        return lastPage;
+    }
+
+    void InsertPage(int pageIndex, int keep) {
+        int frameIndex = TakeFrame(keep);
+        for (int i = 0; i < frames.GetSize(); ++i) {
+            Frame& frame = frames.AtUnchecked(i);
+            if (frame.page >= pageIndex) {
+                frame.page++;
+            }
+        }
+        Page page;
+        page.count = 0;
+        page.slot = -1;
+        page.frame = frameIndex;
+        pages.Insert(page, pageIndex);
+        if (pageIndex == pageSums.GetSize()) {
+            int i = pageIndex + 1;
+            pageSums.Append(ItemsBefore(pageIndex) - ItemsBefore(i - (i & -i)));
+        }
+        else {
+            RebuildPageSums();
+        }
+        Frame& frame = frames.AtUnchecked(frameIndex);
+        frame.page = pageIndex;
+        frame.dirty = true;
+        frame.referenced = true;
+        lastPage = 0;
+        lastStart = 0;
+    }
+
+    // Moves the upper half of a full page into a new page after it.
+    void Split(int pageIndex) {
+        T* items = Load(pageIndex);
+        InsertPage(pageIndex + 1, pageIndex);
+        Page& page = pages.AtUnchecked(pageIndex);
+        Page& next = pages.AtUnchecked(pageIndex + 1);
+        int kept = PageItems / 2;
+        int moved = page.count - kept;
+        memcpy(frames.AtUnchecked(next.frame).items.get(), items + kept, moved * sizeof(T));
+        AddItems(pageIndex, -moved);
+        AddItems(pageIndex + 1, moved);
+    }
+
+    void Swap(SpillingSequence<T, PageBytes>& other) {
+        swap(memoryBudget, other.memoryBudget);
+        swap(frameLimit, other.frameLimit);
+        swap(size, other.size);
+        swap(pages, other.pages);
+        swap(frames, other.frames);
+        swap(pageSums, other.pageSums);
+        swap(hand, other.hand);
+        swap(lastMiss, other.lastMiss);
+        swap(lastPage, other.lastPage);
+        swap(lastStart, other.lastStart);
+        swap(file, other.file);
+        swap(slotCount, other.slotCount);
+    }
+
+public:
+    explicit SpillingSequence(size_t memoryBudget = 64 << 20)
+        : memoryBudget(memoryBudget),
+          frameLimit(static_cast<int>(min<size_t>(max<size_t>(memoryBudget / (PageItems * sizeof(T)), 2), INT_MAX))),
+          size(0), pages(0), frames(0), pageSums(0), hand(0), lastMiss(-2), lastPage(0), lastStart(0), file(nullptr), slotCount(0) {}
+
+    SpillingSequence(T* items, int count, size_t memoryBudget = 64 << 20) : SpillingSequence(memoryBudget) {
+        for (int i = 0; i < count; ++i) {
+            Append(items[i]);
+        }
+    }
+
+    SpillingSequence(const SpillingSequence<T, PageBytes>& other) : SpillingSequence(other.memoryBudget) {
+        other.ForEach([&](const T& item) {
+            Append(item);
+        });
+    }
+
+    SpillingSequence<T, PageBytes>& operator=(const SpillingSequence<T, PageBytes>&) = delete;
+
+    ~SpillingSequence() {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    size_t GetMemoryBudget() const {
+        return memoryBudget;
+    }
+
+    int GetPageCount() const {
+        return pages.GetSize();
+    }
+
+    int GetResidentPageCount() const {
+        return frames.GetSize();
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        for (int p = 0; p < pages.GetSize(); ++p) {
+            const T* items = Load(p);
+            int count = pages.AtUnchecked(p).count;
+            for (int i = 0; i < count; ++i) {
+                func(items[i]);
+            }
+        }
+    }
+
+    T GetFirst() override {
+        if (size == 0) throw IndexOutOfRange();
+        return Get(0);
+    }
+
+    T GetLast() override {
+        if (size == 0) throw IndexOutOfRange();
+        return Get(size - 1);
+    }
+
+    T Get(int index) const override {
+        if (index < 0 || index >= size) throw IndexOutOfRange();
+        int position;
+        int pageIndex = Locate(index, position);
+        return Load(pageIndex)[position];
+    }
+
+    int GetSize() const override {
+        return size;
+    }
+
+    void Append(T item) override {
+        if (pages.GetSize() == 0 || pages.AtUnchecked(pages.GetSize() - 1).count == PageItems) {
+            InsertPage(pages.GetSize(), -1);
+        }
+        int last = pages.GetSize() - 1;
+        T* items = Load(last);
+        items[pages.AtUnchecked(last).count] = item;
+        AddItems(last, 1);
+        Touch(last);
+        size++;
+    }
+
+    void Prepend(T item) override {
+        Insert(item, 0);
+    }
+
+    void Insert(T item, int index) override {
+        if (index < 0 || index > size) throw IndexOutOfRange();
+        if (index == size) {
+            Append(item);
+            return;
+        }
+        int position;
+        int pageIndex = Locate(index, position);
+        if (pages.AtUnchecked(pageIndex).count == PageItems) {
+            Split(pageIndex);
+            int kept = pages.AtUnchecked(pageIndex).count;
+            if (position > kept) {
+                position -= kept;
+                pageIndex++;
+            }
+        }
+        T* items = Load(pageIndex);
+        memmove(items + position + 1, items + position, (pages.AtUnchecked(pageIndex).count - position) * sizeof(T));
+        items[position] = item;
+        AddItems(pageIndex, 1);
+        Touch(pageIndex);
+        size++;
+        // Pages up to this one keep their starts.
+        lastPage = pageIndex;
+        lastStart = index - position;
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= size || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        SpillingSequence<T, PageBytes>* subSequence = new SpillingSequence<T, PageBytes>(memoryBudget);
+        for (int i = startIndex; i <= endIndex; ++i) {
+            subSequence->Append(Get(i));
+        }
+        return subSequence;
+    }
+
+    Sequence<T>* Concat(Sequence<T>* list) override {
+        SpillingSequence<T, PageBytes>* result = new SpillingSequence<T, PageBytes>(*this);
+        list->Visit([&](const T& item) {
+            result->Append(item);
+        });
+        return result;
+    }
+
+    Sequence<T>* Map(function<T(T)> func) override {
+        SpillingSequence<T, PageBytes>* result = new SpillingSequence<T, PageBytes>(memoryBudget);
+        ForEach([&](const T& item) {
+            result->Append(func(item));
+        });
+        return result;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override {
+        SpillingSequence<T, PageBytes>* result = new SpillingSequence<T, PageBytes>(memoryBudget);
+        other.Visit([&](const T& item) {
+            result->Append(item);
+        });
+        return result;
+    }
+
+    Sequence<T>* Zip(const Sequence<T>& other) const override {
+        SpillingSequence<T, PageBytes>* result = new SpillingSequence<T, PageBytes>(memoryBudget);
+        int minSize = min(size, other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(Get(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    bool TryGet(int index, T& value) override {
+        if (index < 0 || index >= size) {
+            return false;
+        }
+        value = Get(index);
+        return true;
+    }
+
+    bool TryFind(function<bool(T)> predicate, T& value) override {
+        for (int p = 0; p < pages.GetSize(); ++p) {
+            const T* items = Load(p);
+            int count = pages.AtUnchecked(p).count;
+            for (int i = 0; i < count; ++i) {
+                if (predicate(items[i])) {
+                    value = items[i];
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    T& operator[](int index) override {
+        if (index < 0 || index >= size) throw IndexOutOfRange();
+        int position;
+        int pageIndex = Locate(index, position);
+        T* items = Load(pageIndex);
+        Touch(pageIndex);
+        return items[position];
+    }
+
+    const T& operator[](int index) const override {
+        if (index < 0 || index >= size) throw IndexOutOfRange();
+        int position;
+        int pageIndex = Locate(index, position);
+        return Load(pageIndex)[position];
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new SpillingSequence<T, PageBytes>(*this);
+    }
+
+protected:
+    // External merge sort: runs of half the cache are sorted in memory and
+    // written back, then merged into a new sequence with the same budget,
+    // so sorting holds up to about twice the budget.
+    void SortItems(const typename Sequence<T>::Comparator& less, bool stable) override {
+        int runPages = max(1, frameLimit / 2);
+        DynamicArray<T> buffer(runPages * PageItems);
+        DynamicArray<int> runs(0);
+        for (int first = 0; first < pages.GetSize(); first += runPages) {
+            int last = min(first + runPages, pages.GetSize());
+            int count = 0;
+            for (int p = first; p < last; ++p) {
+                memcpy(buffer.GetData() + count, Load(p), pages.AtUnchecked(p).count * sizeof(T));
+                count += pages.AtUnchecked(p).count;
+            }
+            SortBuffer(buffer.GetData(), count, less, stable);
+            count = 0;
+            for (int p = first; p < last; ++p) {
+                memcpy(Load(p), buffer.GetData() + count, pages.AtUnchecked(p).count * sizeof(T));
+                Touch(p);
+                count += pages.AtUnchecked(p).count;
+            }
+            runs.Append(first);
+        }
+        buffer = DynamicArray<T>(0);
+
+        int runCount = runs.GetSize();
+        DynamicArray<int> page(runCount);
+        DynamicArray<int> position(runCount);
+        DynamicArray<T> heads(runCount);
+        DynamicArray<int> heap(0);
+        for (int r = 0; r < runCount; ++r) {
+            page.AtUnchecked(r) = runs.AtUnchecked(r);
+            position.AtUnchecked(r) = 0;
+            if (pages.AtUnchecked(page.AtUnchecked(r)).count > 0) {
+                heads.AtUnchecked(r) = Load(page.AtUnchecked(r))[0];
+                heap.Append(r);
+            }
+        }
+        auto after = [&](int a, int b) {
+            const T& x = heads.AtUnchecked(a);
+            const T& y = heads.AtUnchecked(b);
+            if (less(y, x)) {
+                return true;
+            }
+            if (less(x, y)) {
+                return false;
+            }
+            return a > b;
+        };
+        int* heapBegin = heap.GetData();
+        int heapSize = heap.GetSize();
+        make_heap(heapBegin, heapBegin + heapSize, after);
+
+        SpillingSequence<T, PageBytes> merged(memoryBudget);
+        while (heapSize > 0) {
+            pop_heap(heapBegin, heapBegin + heapSize, after);
+            int run = heapBegin[heapSize - 1];
+            merged.Append(heads.AtUnchecked(run));
+            int end = run + 1 < runCount ? runs.AtUnchecked(run + 1) : pages.GetSize();
+            int& current = page.AtUnchecked(run);
+            int& offset = position.AtUnchecked(run);
+            if (++offset == pages.AtUnchecked(current).count) {
+                offset = 0;
+                do {
+                    ++current;
+                } while (current < end && pages.AtUnchecked(current).count == 0);
+            }
+            if (current < end) {
+                heads.AtUnchecked(run) = Load(current)[offset];
+                push_heap(heapBegin, heapBegin + heapSize, after);
+            }
+            else {
+                heapSize--;
+            }
+        }
+        Swap(merged);
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        ForEach(visitor);
+    }
+};
+
+// Immutable int sequence compressed with frame of reference: each block of
+// 128 values keeps its minimum and the offsets from it bit-packed at the
+// width of the largest, in 4 * width words. Get decodes one value through
+// the block header in O(1); scans, Sum and Map unpack whole blocks with a
+// loop specialised per width, which the compiler unrolls and vectorizes.
+// Writes go through Set to one decoded block that is packed back when
+// another block is touched; widening a block in the middle moves the words
+// after it. Values exist only decoded, so there are no stable references to
+// hand out and operator[] throws UnsupportedOperation.
+class PackedIntSequence : public Sequence<int> {
+private:
+    enum { BlockShift = 7, BlockSize = 1 << BlockShift, BlockMask = BlockSize - 1 };
+
+    struct Block {
+        int reference;
+        int offset;
+        int bits;
+    };
+
+    typedef void (*Unpacker)(const uint32_t*, uint32_t, int*);
+
+    int size;
+    // Packed storage and the decoded block together hold the values, so
+    // reads that switch blocks pack back a written one.
+    mutable DynamicArray<Block> blocks;
+    mutable DynamicArray<uint32_t> words;
+    mutable int cache[BlockSize];
+    mutable int cachedBlock;
+    mutable bool dirty;
+
+    // Every 32 values take exactly Bits words, so the shifts repeat per group.
+    template <int Bits>
+    static void UnpackBlock(const uint32_t* in, uint32_t reference, int* out) {
+        if (Bits == 0) {
+            for (int i = 0; i < BlockSize; ++i) {
+                out[i] = static_cast<int>(reference);
+            }
+            return;
+        }
+        const uint32_t mask = Bits == 32 ? 0xffffffffu : (1u << (Bits & 31)) - 1;
+        for (int group = 0; group < BlockSize / 32; ++group) {
+            const uint32_t* current = in + group * Bits;
+            int* target = out + group * 32;
+            for (int i = 0; i < 32; ++i) {
+                const int bit = i * Bits;
+                uint32_t value = current[bit >> 5] >> (bit & 31);
+                if ((bit & 31) + Bits > 32) {
+                    value |= current[(bit >> 5) + 1] << ((32 - (bit & 31)) & 31);
+                }
+                target[i] = static_cast<int>(reference + (value & mask));
+            }
+        }
+    }
+
+    template <int... Bits>
+    static Unpacker SelectUnpacker(int bits, integer_sequence<int, Bits...>) {
+        static const Unpacker unpackers[] = {&UnpackBlock<Bits>...};
+        return unpackers[bits];
+    }
+
+    static void Pack(const int* values, int count, uint32_t reference, int bits, uint32_t* out) {
+        for (int i = 0; i < 4 * bits; ++i) {
+            out[i] = 0;
+        }
+        if (bits == 0) {
+            return;
+        }
+        for (int i = 0; i < count; ++i) {
+            uint32_t value = static_cast<uint32_t>(values[i]) - reference;
+            int bit = i * bits;
+            out[bit >> 5] |= value << (bit & 31);
+            if ((bit & 31) + bits > 32) {
+                out[(bit >> 5) + 1] |= value >> (32 - (bit & 31));
+            }
+        }
+    }
+
+    int BlockCount(int block) const {
+        return min(static_cast<int>(BlockSize), size - (block << BlockShift));
+    }
+
+    void Unpack(int block, int* out) const {
+        const Block& header = blocks.AtUnchecked(block);
+        SelectUnpacker(header.bits, make_integer_sequence<int, 33>())(
+            words.GetData() + header.offset, static_cast<uint32_t>(header.reference), out);
+    }
+
+    int Decode(int block, int position) const {
+        const Block& header = blocks.AtUnchecked(block);
+        if (header.bits == 0) {
+            return header.reference;
+        }
+        const uint32_t* in = words.GetData() + header.offset;
+        int bit = position * header.bits;
+        uint32_t value = in[bit >> 5] >> (bit & 31);
+        if ((bit & 31) + header.bits > 32) {
+            value |= in[(bit >> 5) + 1] << (32 - (bit & 31));
+        }
+        uint32_t mask = header.bits == 32 ? 0xffffffffu : (1u << header.bits) - 1;
+        return static_cast<int>(static_cast<uint32_t>(header.reference) + (value & mask));
+    }
+
+    // Packs the decoded block back, at least as wide as before unless it is
+    // the last one, so that rewriting a block rarely moves the others.
+    void WriteBack() const {
+        if (!dirty) {
+            return;
+        }
+        dirty = false;
+        int count = BlockCount(cachedBlock);
+        int low = cache[0];
+        int high = cache[0];
+        for (int i = 1; i < count; ++i) {
+            low = min(low, cache[i]);
+            high = max(high, cache[i]);
+        }
+        uint32_t range = static_cast<uint32_t>(high) - static_cast<uint32_t>(low);
+        int bits = 0;
+        while (bits < 32 && (range >> bits) != 0) {
+            ++bits;
+        }
+        Block& header = blocks.AtUnchecked(cachedBlock);
+        if (cachedBlock != blocks.GetSize() - 1) {
+            bits = max(bits, header.bits);
+        }
+        int delta = 4 * (bits - header.bits);
+        if (delta != 0) {
+            int tail = header.offset + 4 * header.bits;
+            int total = words.GetSize();
+            if (delta > 0) {
+                if (total + delta > words.GetCapacity()) {
+                    words.Reserve(max(total + delta, 2 * words.GetCapacity()));
+                }
+                words.Resize(total + delta);
+            }
+            uint32_t* data = words.GetData();
+            memmove(data + tail + delta, data + tail, (total - tail) * sizeof(uint32_t));
+            if (delta < 0) {
+                words.Resize(total + delta);
+            }
+            for (int b = cachedBlock + 1; b < blocks.GetSize(); ++b) {
+                blocks.AtUnchecked(b).offset += delta;
+            }
+        }
+        header.bits = bits;
+        header.reference = low;
+        Pack(cache, count, static_cast<uint32_t>(low), bits, words.GetData() + header.offset);
+    }
+
+    void Load(int block) const {
+        if (block != cachedBlock) {
+            WriteBack();
+            Unpack(block, cache);
+            cachedBlock = block;
+        }
+    }
+
+    // Replaces the contents with count values, packing them block by block.
+    void Rebuild(const int* values, int count) {
+        blocks = DynamicArray<Block>(0);
+        words = DynamicArray<uint32_t>(0);
+        cachedBlock = -1;
+        dirty = false;
+        size = 0;
+        for (int i = 0; i < count; ++i) {
+            Append(values[i]);
+        }
+        WriteBack();
+    }
+
+    DynamicArray<int> ToArray() const {
+        DynamicArray<int> items(size);
+        int* data = items.GetData();
+        int position = 0;
+        ForEach([&](int item) {
+            data[position++] = item;
+        });
+        return items;
+    }
+
+public:
+    PackedIntSequence() : size(0), blocks(0), words(0), cachedBlock(-1), dirty(false) {}
+
+    PackedIntSequence(int* items, int count) : PackedIntSequence() {
+        Rebuild(items, count);
+    }
+
+    PackedIntSequence(const Sequence<int>& other) : PackedIntSequence() {
+        other.Visit([&](const int& item) {
+            Append(item);
+        });
+        WriteBack();
+    }
+
+    // Bytes taken by the packed values and the block headers.
+    size_t GetCompressedBytes() const {
+        WriteBack();
+        return words.GetSize() * sizeof(uint32_t) + blocks.GetSize() * sizeof(Block);
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        int buffer[BlockSize];
+        for (int block = 0; block < blocks.GetSize(); ++block) {
+            const int* values = cache;
+            if (block != cachedBlock) {
+                Unpack(block, buffer);
+                values = buffer;
+            }
+            int count = BlockCount(block);
+            for (int i = 0; i < count; ++i) {
+                func(values[i]);
+            }
+        }
+    }
+
+    long long Sum() const {
+        long long sum = 0;
+        int buffer[BlockSize];
+        for (int block = 0; block < blocks.GetSize(); ++block) {
+            const int* values = cache;
+            if (block != cachedBlock) {
+                Unpack(block, buffer);
+                values = buffer;
+            }
+            int count = BlockCount(block);
+            for (int i = 0; i < count; ++i) {
+                sum += values[i];
+            }
+        }
+        return sum;
+    }
+
+    int GetFirst() override {
+        if (size == 0) throw IndexOutOfRange();
+        return Get(0);
+    }
+
+    int GetLast() override {
+        if (size == 0) throw IndexOutOfRange();
+        return Get(size - 1);
+    }
+
+    int Get(int index) const override {
+        if (index < 0 || index >= size) throw IndexOutOfRange();
+        int block = index >> BlockShift;
+        if (block == cachedBlock) {
+            return cache[index & BlockMask];
+        }
+        return Decode(block, index & BlockMask);
+    }
+
+    int GetSize() const override {
+        return size;
+    }
+
+    void Append(int item) override {
+        if ((size & BlockMask) == 0) {
+            WriteBack();
+            Block header;
+            header.reference = 0;
+            header.offset = words.GetSize();
+            header.bits = 0;
+            blocks.Append(header);
+            cachedBlock = blocks.GetSize() - 1;
+        }
+        else {
+            Load(blocks.GetSize() - 1);
+        }
+        cache[size & BlockMask] = item;
+        size++;
+        dirty = true;
+    }
+
+    void Prepend(int item) override {
+        Insert(item, 0);
+    }
+
+    // Shifts every later value, so the blocks after index are repacked.
+    void Insert(int item, int index) override {
+        if (index < 0 || index > size) throw IndexOutOfRange();
+        if (index == size) {
+            Append(item);
+            return;
+        }
+        DynamicArray<int> items = ToArray();
+        items.Insert(item, index);
+        Rebuild(items.GetData(), items.GetSize());
+    }
+
+    Sequence<int>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= size || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        PackedIntSequence* subSequence = new PackedIntSequence();
+        for (int i = startIndex; i <= endIndex; ++i) {
+            subSequence->Append(Get(i));
+        }
+        return subSequence;
+    }
+
+    Sequence<int>* Concat(Sequence<int>* list) override {
+        PackedIntSequence* result = new PackedIntSequence(*this);
+        list->Visit([&](const int& item) {
+            result->Append(item);
+        });
+        return result;
+    }
+
+    Sequence<int>* Map(function<int(int)> func) override {
+        PackedIntSequence* result = new PackedIntSequence();
+        ForEach([&](int item) {
+            result->Append(func(item));
+        });
+        return result;
+    }
+
+    Sequence<int>* From(const Sequence<int>& other) override {
+        return new PackedIntSequence(other);
+    }
+
+    Sequence<int>* Zip(const Sequence<int>& other) const override {
+        PackedIntSequence* result = new PackedIntSequence();
+        int minSize = min(size, other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(Get(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    bool TryGet(int index, int& value) override {
+        if (index < 0 || index >= size) {
+            return false;
+        }
+        value = Get(index);
+        return true;
+    }
+
+    bool TryFind(function<bool(int)> predicate, int& value) override {
+        int buffer[BlockSize];
+        for (int block = 0; block < blocks.GetSize(); ++block) {
+            const int* values = cache;
+            if (block != cachedBlock) {
+                Unpack(block, buffer);
+                values = buffer;
+            }
+            int count = BlockCount(block);
+            for (int i = 0; i < count; ++i) {
+                if (predicate(values[i])) {
+                    value = values[i];
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void Set(int index, int item) {
+        if (index < 0 || index >= size) throw IndexOutOfRange();
+        Load(index >> BlockShift);
+        cache[index & BlockMask] = item;
+        dirty = true;
+    }
+
+    int& operator[](int) override {
+        throw UnsupportedOperation("PackedIntSequence has no element references; use Set");
+    }
+
+    const int& operator[](int) const override {
+        throw UnsupportedOperation("PackedIntSequence has no element references; use Get");
+    }
+
+    Sequence<int>* Instance() override {
+        return this->Clone();
+    }
+
+    Sequence<int>* Clone() const override {
+        return new PackedIntSequence(*this);
+    }
+
+protected:
+    void SortItems(const Comparator& less, bool stable) override {
+        DynamicArray<int> items = ToArray();
+        SortBuffer(items.GetData(), size, less, stable);
+        Rebuild(items.GetData(), items.GetSize());
+    }
+
+    void Visit(const function<void(const int&)>& visitor) const override {
+        ForEach(visitor);
+    }
+};
+
+// Pairs stored as two columns (struct of arrays), so a pass over either
+// column is a contiguous, vectorizable loop.
+template <class T, class U>
+class ZippedSequence {
+private:
+    DynamicArray<T> firsts;
+    DynamicArray<U> seconds;
+
+public:
+    ZippedSequence() {}
+
+    ZippedSequence(const DynamicArray<T>& firsts, const DynamicArray<U>& seconds) : firsts(firsts), seconds(seconds) {
+        if (firsts.GetSize() != seconds.GetSize()) {
+            throw IndexOutOfRange();
+        }
+    }
+
+    int GetSize() const {
+        return firsts.GetSize();
+    }
+
+    pair<T, U> Get(int index) const {
+        return make_pair(firsts.Get(index), seconds.Get(index));
+    }
+
+    const T& First(int index) const {
+        return firsts.At(index);
+    }
+
+    const U& Second(int index) const {
+        return seconds.At(index);
+    }
+
+    const DynamicArray<T>& GetFirsts() const {
+        return firsts;
+    }
+
+    const DynamicArray<U>& GetSeconds() const {
+        return seconds;
+    }
+
+    void Append(const T& first, const U& second) {
+        firsts.Append(first);
+        seconds.Append(second);
+    }
+
+    // func(first, second) for every pair in order.
+    template <class Func>
+    void ForEach(Func func) const {
+        const T* first = firsts.GetData();
+        const U* second = seconds.GetData();
+        for (int i = 0; i < firsts.GetSize(); ++i) {
+            func(first[i], second[i]);
+        }
+    }
+};
+
+// Lazy zip: reads both inputs in lockstep through Get without allocating.
+// Meant for random-access sequences; the inputs must outlive the view.
+template <class T, class U>
+class ZipView {
+private:
+    const Sequence<T>* first;
+    const Sequence<U>* second;
+
+public:
+    ZipView(const Sequence<T>& first, const Sequence<U>& second) : first(&first), second(&second) {}
+
+    int GetSize() const {
+        return min(first->GetSize(), second->GetSize());
+    }
+
+    pair<T, U> Get(int index) const {
+        if (index < 0 || index >= GetSize()) {
+            throw IndexOutOfRange();
+        }
+        return make_pair(first->Get(index), second->Get(index));
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        int size = GetSize();
+        for (int i = 0; i < size; ++i) {
+            func(first->Get(i), second->Get(i));
+        }
+    }
+};
+
+// Pairs up the elements of two sequences, up to the shorter length.
+template <class T, class U>
+ZippedSequence<T, U> Zip(const Sequence<T>& first, const Sequence<U>& second) {
+    int size = min(first.GetSize(), second.GetSize());
+    DynamicArray<T> firsts(size);
+    DynamicArray<U> seconds(size);
+    T* firstData = firsts.GetData();
+    U* secondData = seconds.GetData();
+    int position = 0;
+    first.Visit([&](const T& item) {
+        if (position < size) {
+            firstData[position++] = item;
+        }
+    });
+    position = 0;
+    second.Visit([&](const U& item) {
+        if (position < size) {
+            secondData[position++] = item;
+        }
+    });
+    return ZippedSequence<T, U>(firsts, seconds);
+}
+
+template <class T, class U>
+ZipView<T, U> ZipLazy(const Sequence<T>& first, const Sequence<U>& second) {
+    return ZipView<T, U>(first, second);
+}
+
+// The columns become the buffers of the two new sequences without copying.
+template <class T, class U>
+pair<Sequence<T>*, Sequence<U>*> Unzip(const ZippedSequence<T, U>& zipped) {
+    return make_pair(new ArraySequence<T>(zipped.GetFirsts()), new ArraySequence<U>(zipped.GetSeconds()));
+}
+
+template <class T, class U>
+pair<Sequence<T>*, Sequence<U>*> Unzip(const Sequence<pair<T, U>>& pairs) {
+    DynamicArray<T> firsts(pairs.GetSize());
+    DynamicArray<U> seconds(pairs.GetSize());
+    T* firstData = firsts.GetData();
+    U* secondData = seconds.GetData();
+    int position = 0;
+    pairs.Visit([&](const pair<T, U>& item) {
+        firstData[position] = item.first;
+        secondData[position] = item.second;
+        position++;
+    });
+    return make_pair(new ArraySequence<T>(firsts), new ArraySequence<U>(seconds));
+}
+
+// Persistent vector: an AVL tree over implicit indices with path copying.
+// Every modification rebuilds only the O(log n) nodes on the path to the
+// changed position; the rest of the tree is shared with older versions.
+template <class T>
+class PersistentArraySequence : public Sequence<T> {
+protected:
+    struct Node;
+    typedef shared_ptr<Node> NodePtr;
+
+    struct Node {
+        T value;
+        NodePtr left;
+        NodePtr right;
+        int size;
+        int height;
+
+        Node(const T& value, const NodePtr& left, const NodePtr& right)
+            : value(value), left(left), right(right),
+              size(SizeOf(left) + SizeOf(right) + 1),
+              height(max(HeightOf(left), HeightOf(right)) + 1) {}
+    };
+
+    NodePtr root;
+
+    static int SizeOf(const NodePtr& node) {
+        return node ? node->size : 0;
+    }
+
+    static int HeightOf(const NodePtr& node) {
+        return node ? node->height : 0;
+    }
+
+    static NodePtr Make(const T& value, const NodePtr& left, const NodePtr& right) {
+        return make_shared<Node>(value, left, right);
+    }
+
+    static NodePtr Balance(const T& value, const NodePtr& left, const NodePtr& right) {
+        if (HeightOf(left) > HeightOf(right) + 1) {
+            if (HeightOf(left->left) >= HeightOf(left->right)) {
+                return Make(left->value, left->left, Make(value, left->right, right));
+            }
+            const NodePtr& middle = left->right;
+            return Make(middle->value, Make(left->value, left->left, middle->left), Make(value, middle->right, right));
+        }
+        if (HeightOf(right) > HeightOf(left) + 1) {
+            if (HeightOf(right->right) >= HeightOf(right->left)) {
+                return Make(right->value, Make(value, left, right->left), right->right);
+            }
+            const NodePtr& middle = right->left;
+            return Make(middle->value, Make(value, left, middle->left), Make(right->value, middle->right, right->right));
+        }
+        return Make(value, left, right);
+    }
+
+    static NodePtr InsertAt(const NodePtr& node, int index, const T& item) {
+        if (!node) {
+            return Make(item, nullptr, nullptr);
+        }
+        int leftSize = SizeOf(node->left);
+        if (index <= leftSize) {
+            return Balance(node->value, InsertAt(node->left, index, item), node->right);
+        }
+        return Balance(node->value, node->left, InsertAt(node->right, index - leftSize - 1, item));
+    }
+
+    template <class Items>
+    static NodePtr Build(const Items& items, int begin, int end) {
+        if (begin >= end) {
+            return nullptr;
+        }
+        int middle = begin + (end - begin) / 2;
+        return Make(items[middle], Build(items, begin, middle), Build(items, middle + 1, end));
+    }
+
+    static const Node* FindNode(const Node* node, int index) {
+        while (true) {
+            int leftSize = SizeOf(node->left);
+            if (index < leftSize) {
+                node = node->left.get();
+            }
+            else if (index == leftSize) {
+                return node;
+            }
+            else {
+                index -= leftSize + 1;
+                node = node->right.get();
+            }
+        }
+    }
+
+    // Copies only the nodes on the path that are shared with another version.
+    static T& Detach(NodePtr& node, int index) {
+        NodePtr* current = &node;
+        while (true) {
+            if (current->use_count() > 1) {
+                *current = make_shared<Node>(**current);
+            }
+            Node* raw = current->get();
+            int leftSize = SizeOf(raw->left);
+            if (index < leftSize) {
+                current = &raw->left;
+            }
+            else if (index == leftSize) {
+                return raw->value;
+            }
+            else {
+                index -= leftSize + 1;
+                current = &raw->right;
+            }
+        }
+    }
+
+    template <class Func>
+    static void Traverse(const Node* node, Func& func) {
+        while (node != nullptr) {
+            Traverse(node->left.get(), func);
+            func(node->value);
+            node = node->right.get();
+        }
+    }
+
+    // Leftmost node whose value satisfies predicate, or null, without
+    // visiting the nodes after it.
+    template <class Predicate>
+    static const Node* FindFirst(const Node* node, Predicate& predicate) {
+        while (node != nullptr) {
+            const Node* found = FindFirst(node->left.get(), predicate);
+            if (found) {
+                return found;
+            }
+            if (predicate(node->value)) {
+                return node;
+            }
+            node = node->right.get();
+        }
+        return nullptr;
+    }
+
+public:
+    PersistentArraySequence() = default;
+
+    PersistentArraySequence(T* items, int count) : root(Build(items, 0, count)) {}
+
+    PersistentArraySequence(const PersistentArraySequence<T>& other) : root(other.root) {}
+
+    PersistentArraySequence(const Sequence<T>& other) {
+        DynamicArray<T> items(other.GetSize());
+        for (int i = 0; i < other.GetSize(); ++i) {
+            items.AtUnchecked(i) = other.Get(i);
+        }
+        root = Build(items, 0, items.GetSize());
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        Traverse(root.get(), func);
+    }
+
+    T GetFirst() override {
+        if (!root) throw IndexOutOfRange();
+        return FindNode(root.get(), 0)->value;
+    }
+
+    T GetLast() override {
+        if (!root) throw IndexOutOfRange();
+        return FindNode(root.get(), root->size - 1)->value;
+    }
+
+    T Get(int index) const override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return FindNode(root.get(), index)->value;
+    }
+
+    int GetSize() const override {
+        return SizeOf(root);
+    }
+
+    void Set(int index, T item) {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        Detach(root, index) = item;
+    }
+
+    void Append(T item) override {
+        root = InsertAt(root, GetSize(), item);
+    }
+
+    void Prepend(T item) override {
+        root = InsertAt(root, 0, item);
+    }
+
+    void Insert(T item, int index) override {
+        if (index < 0 || index > GetSize()) throw IndexOutOfRange();
+        root = InsertAt(root, index, item);
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= GetSize() || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        DynamicArray<T> items(endIndex - startIndex + 1);
+        int index = 0;
+        ForEach([&](const T& item) {
+            if (index >= startIndex && index <= endIndex) {
+                items.AtUnchecked(index - startIndex) = item;
+            }
+            ++index;
+        });
+        PersistentArraySequence<T>* subSequence = new PersistentArraySequence<T>();
+        subSequence->root = Build(items, 0, items.GetSize());
+        return subSequence;
+    }
+
+    Sequence<T>* Concat(Sequence<T>* other) override {
+        PersistentArraySequence<T>* result = new PersistentArraySequence<T>(*this);
+        for (int i = 0; i < other->GetSize(); ++i) {
+            result->Append(other->Get(i));
+        }
+        return result;
+    }
+
+    Sequence<T>* Map(function<T(T)> func) override {
+        DynamicArray<T> items(GetSize());
+        int index = 0;
+        ForEach([&](const T& item) {
+            items.AtUnchecked(index++) = func(item);
+        });
+        PersistentArraySequence<T>* result = new PersistentArraySequence<T>();
+        result->root = Build(items, 0, items.GetSize());
+        return result;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override {
+        return new PersistentArraySequence<T>(other);
+    }
+
+    Sequence<T>* Zip(const Sequence<T>& other) const override {
+        PersistentArraySequence<T>* result = new PersistentArraySequence<T>();
+        int minSize = min(this->GetSize(), other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(this->Get(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    bool TryGet(int index, T& value) override {
+        if (index < 0 || index >= GetSize()) {
+            return false;
+        }
+        value = FindNode(root.get(), index)->value;
+        return true;
+    }
+
+    bool TryFind(function<bool(T)> predicate, T& value) override {
+        const Node* node = FindFirst(root.get(), predicate);
+        if (!node) {
+            return false;
+        }
+        value = node->value;
+        return true;
+    }
+
+    T& operator[](int index) override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return Detach(root, index);
+    }
+
+    const T& operator[](int index) const override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return FindNode(root.get(), index)->value;
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new PersistentArraySequence<T>(*this);
+    }
+
+protected:
+    // Sorting touches every element, so the tree is rebuilt rather than
+    // path-copied once per position.
+    void SortItems(const typename Sequence<T>::Comparator& less, bool stable) override {
+        int size = SizeOf(root);
+        DynamicArray<T> items(size);
+        int position = 0;
+        ForEach([&](const T& item) {
+            items.AtUnchecked(position++) = item;
+        });
+        SortBuffer(items.GetData(), size, less, stable);
+        root = Build(items, 0, size);
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        ForEach(visitor);
+    }
+};
+
+template <class T>
+class ImmutableArraySequence : public PersistentArraySequence<T> {
+public:
+    using PersistentArraySequence<T>::PersistentArraySequence;
+
+    ImmutableArraySequence(const ImmutableArraySequence<T>& other) : PersistentArraySequence<T>(other) {}
+
+    Sequence<T>* Instance() override {
+        return this->Clone();
+    }
+
+    Sequence<T>* Clone() const override {
+        return new ImmutableArraySequence<T>(*this);
+    }
+};
+
+// Runs of equal values as (value, length) nodes of an AVL tree that also
+// keeps the element count of each subtree, so Get, Insert and Set take
+// O(log runs). Updates split the tree at the index and join it back,
+// merging neighbouring runs that end up equal; nodes are shared between
+// copies as in PersistentArraySequence. Writes through operator[] are
+// staged and applied on the next access. T needs operator==.
+template <class T>
+class RunLengthSequence : public Sequence<T> {
+private:
+    struct Node;
+    typedef shared_ptr<Node> NodePtr;
+
+    struct Node {
+        T value;
+        int length;
+        NodePtr left;
+        NodePtr right;
+        int size;
+        int runs;
+        int height;
+
+        Node(const T& value, int length, const NodePtr& left, const NodePtr& right)
+            : value(value), length(length), left(left), right(right),
+              size(SizeOf(left) + SizeOf(right) + length),
+              runs(RunsOf(left) + RunsOf(right) + 1),
+              height(max(HeightOf(left), HeightOf(right)) + 1) {}
+    };
+
+    struct Run {
+        T value;
+        int length;
+    };
+
+    mutable NodePtr root;
+    mutable int pendingIndex;
+    mutable T pendingValue;
+
+    static int SizeOf(const NodePtr& node) {
+        return node ? node->size : 0;
+    }
+
+    static int RunsOf(const NodePtr& node) {
+        return node ? node->runs : 0;
+    }
+
+    static int HeightOf(const NodePtr& node) {
+        return node ? node->height : 0;
+    }
+
+    static NodePtr Make(const T& value, int length, const NodePtr& left, const NodePtr& right) {
+        return make_shared<Node>(value, length, left, right);
+    }
+
+    static NodePtr Balance(const T& value, int length, const NodePtr& left, const NodePtr& right) {
+        if (HeightOf(left) > HeightOf(right) + 1) {
+            if (HeightOf(left->left) >= HeightOf(left->right)) {
+                return Make(left->value, left->length, left->left, Make(value, length, left->right, right));
+            }
+            const NodePtr& middle = left->right;
+            return Make(middle->value, middle->length, Make(left->value, left->length, left->left, middle->left),
+                Make(value, length, middle->right, right));
+        }
+        if (HeightOf(right) > HeightOf(left) + 1) {
+            if (HeightOf(right->right) >= HeightOf(right->left)) {
+                return Make(right->value, right->length, Make(value, length, left, right->left), right->right);
+            }
+            const NodePtr& middle = right->left;
+            return Make(middle->value, middle->length, Make(value, length, left, middle->left),
+                Make(right->value, right->length, middle->right, right->right));
+        }
+        return Make(value, length, left, right);
+    }
+
+    // Joins left, the run and right, whatever their heights.
+    static NodePtr Join(const NodePtr& left, const T& value, int length, const NodePtr& right) {
+        if (HeightOf(left) > HeightOf(right) + 1) {
+            return Balance(left->value, left->length, left->left, Join(left->right, value, length, right));
+        }
+        if (HeightOf(right) > HeightOf(left) + 1) {
+            return Balance(right->value, right->length, Join(left, value, length, right->left), right->right);
+        }
+        return Make(value, length, left, right);
+    }
+
+    // Left holds the first index elements; a run across index is cut in two.
+    static void Split(const NodePtr& node, int index, NodePtr& left, NodePtr& right) {
+        if (!node) {
+            left = nullptr;
+            right = nullptr;
+            return;
+        }
+        int leftSize = SizeOf(node->left);
+        if (index <= leftSize) {
+            NodePtr middle;
+            Split(node->left, index, left, middle);
+            right = Join(middle, node->value, node->length, node->right);
+        }
+        else if (index >= leftSize + node->length) {
+            NodePtr middle;
+            Split(node->right, index - leftSize - node->length, middle, right);
+            left = Join(node->left, node->value, node->length, middle);
+        }
+        else {
+            int position = index - leftSize;
+            left = Join(node->left, node->value, position, nullptr);
+            right = Join(nullptr, node->value, node->length - position, node->right);
+        }
+    }
+
+    static const Node* FirstRun(const NodePtr& node) {
+        const Node* current = node.get();
+        while (current->left) {
+            current = current->left.get();
+        }
+        return current;
+    }
+
+    static const Node* LastRun(const NodePtr& node) {
+        const Node* current = node.get();
+        while (current->right) {
+            current = current->right.get();
+        }
+        return current;
+    }
+
+    static NodePtr RemoveFirst(const NodePtr& node) {
+        if (!node->left) {
+            return node->right;
+        }
+        return Balance(node->value, node->length, RemoveFirst(node->left), node->right);
+    }
+
+    static NodePtr RemoveLast(const NodePtr& node) {
+        if (!node->right) {
+            return node->left;
+        }
+        return Balance(node->value, node->length, node->left, RemoveLast(node->right));
+    }
+
+    // Concatenates two trees, merging the runs that meet if they are equal.
+    static NodePtr Concatenate(const NodePtr& left, const NodePtr& right) {
+        if (!left) {
+            return right;
+        }
+        if (!right) {
+            return left;
+        }
+        const Node* last = LastRun(left);
+        const Node* first = FirstRun(right);
+        if (last->value == first->value) {
+            return Join(RemoveLast(left), last->value, last->length + first->length, RemoveFirst(right));
+        }
+        return Join(left, first->value, first->length, RemoveFirst(right));
+    }
+
+    static const Node* FindRun(const Node* node, int index) {
+        while (true) {
+            int leftSize = SizeOf(node->left);
+            if (index < leftSize) {
+                node = node->left.get();
+            }
+            else if (index < leftSize + node->length) {
+                return node;
+            }
+            else {
+                index -= leftSize + node->length;
+                node = node->right.get();
+            }
+        }
+    }
+
+    static NodePtr Build(const DynamicArray<Run>& runs, int begin, int end) {
+        if (begin >= end) {
+            return nullptr;
+        }
+        int middle = begin + (end - begin) / 2;
+        const Run& run = runs.AtUnchecked(middle);
+        return Make(run.value, run.length, Build(runs, begin, middle), Build(runs, middle + 1, end));
+    }
+
+    template <class Func>
+    static void TraverseRuns(const Node* node, Func& func) {
+        while (node != nullptr) {
+            TraverseRuns(node->left.get(), func);
+            func(node->value, node->length);
+            node = node->right.get();
+        }
+    }
+
+    // Returns the leftmost run whose value satisfies predicate, or null,
+    // without visiting the runs after it.
+    template <class Predicate>
+    static const Node* FindFirstRun(const Node* node, Predicate& predicate) {
+        while (node != nullptr) {
+            const Node* found = FindFirstRun(node->left.get(), predicate);
+            if (found) {
+                return found;
+            }
+            if (predicate(node->value)) {
+                return node;
+            }
+            node = node->right.get();
+        }
+        return nullptr;
+    }
+
+    static void AddRun(DynamicArray<Run>& runs, const T& value, int length) {
+        if (runs.GetSize() > 0 && runs.AtUnchecked(runs.GetSize() - 1).value == value) {
+            runs.AtUnchecked(runs.GetSize() - 1).length += length;
+            return;
+        }
+        Run run;
+        run.value = value;
+        run.length = length;
+        runs.Append(run);
+    }
+
+    static NodePtr Replace(const NodePtr& node, int index, int count, const T& item) {
+        NodePtr left;
+        NodePtr rest;
+        NodePtr removed;
+        NodePtr right;
+        Split(node, index, left, rest);
+        Split(rest, count, removed, right);
+        return Concatenate(Concatenate(left, Make(item, 1, nullptr, nullptr)), right);
+    }
+
+    // Grows the last run in place when it equals item and no copy shares the
+    // nodes on the right spine, which makes building by Append cheap.
+    bool ExtendLast(const T& item) {
+        NodePtr* current = &root;
+        while (*current) {
+            if (current->use_count() > 1) {
+                return false;
+            }
+            if (!(*current)->right) {
+                break;
+            }
+            current = &(*current)->right;
+        }
+        if (!*current || !((*current)->value == item)) {
+            return false;
+        }
+        for (Node* node = root.get(); node != nullptr; node = node->right.get()) {
+            node->size++;
+        }
+        (*current)->length++;
+        return true;
+    }
+
+    void Flush() const {
+        if (pendingIndex >= 0) {
+            int index = pendingIndex;
+            pendingIndex = -1;
+            // Reads through operator[] leave the value as it was; only a
+            // real change is worth the split and join.
+            if (!(FindRun(root.get(), index)->value == pendingValue)) {
+                root = Replace(root, index, 1, pendingValue);
+            }
+        }
+    }
+
+    const NodePtr& Root() const {
+        Flush();
+        return root;
+    }
+
+public:
+    RunLengthSequence() : pendingIndex(-1), pendingValue() {}
+
+    RunLengthSequence(T* items, int count) : RunLengthSequence() {
+        DynamicArray<Run> runs(0);
+        for (int i = 0; i < count; ++i) {
+            AddRun(runs, items[i], 1);
+        }
+        root = Build(runs, 0, runs.GetSize());
+    }
+
+    RunLengthSequence(const RunLengthSequence<T>& other) : RunLengthSequence() {
+        root = other.Root();
+    }
+
+    RunLengthSequence(const Sequence<T>& other) : RunLengthSequence() {
+        DynamicArray<Run> runs(0);
+        other.Visit([&](const T& item) {
+            AddRun(runs, item, 1);
+        });
+        root = Build(runs, 0, runs.GetSize());
+    }
+
+    int GetRunCount() const {
+        return RunsOf(Root());
+    }
+
+    // Calls func(value, length) once per run, in order.
+    template <class Func>
+    void ForEachRun(Func func) const {
+        TraverseRuns(Root().get(), func);
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        ForEachRun([&](const T& value, int length) {
+            for (int i = 0; i < length; ++i) {
+                func(value);
+            }
+        });
+    }
+
+    T GetFirst() override {
+        if (GetSize() == 0) throw IndexOutOfRange();
+        return FirstRun(Root())->value;
+    }
+
+    T GetLast() override {
+        if (GetSize() == 0) throw IndexOutOfRange();
+        return LastRun(Root())->value;
+    }
+
+    T Get(int index) const override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        if (index == pendingIndex) {
+            return pendingValue;
+        }
+        return FindRun(root.get(), index)->value;
+    }
+
+    int GetSize() const override {
+        return SizeOf(root);
+    }
+
+    void Set(int index, T item) {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        root = Replace(Root(), index, 1, item);
+    }
+
+    void Append(T item) override {
+        Flush();
+        if (!ExtendLast(item)) {
+            root = Concatenate(root, Make(item, 1, nullptr, nullptr));
+        }
+    }
+
+    void Prepend(T item) override {
+        root = Concatenate(Make(item, 1, nullptr, nullptr), Root());
+    }
+
+    void Insert(T item, int index) override {
+        if (index < 0 || index > GetSize()) throw IndexOutOfRange();
+        root = Replace(Root(), index, 0, item);
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= GetSize() || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        NodePtr before;
+        NodePtr rest;
+        NodePtr after;
+        RunLengthSequence<T>* subSequence = new RunLengthSequence<T>();
+        Split(Root(), startIndex, before, rest);
+        Split(rest, endIndex - startIndex + 1, subSequence->root, after);
+        return subSequence;
+    }
+
+    Sequence<T>* Concat(Sequence<T>* list) override {
+        RunLengthSequence<T>* result = new RunLengthSequence<T>(*list);
+        result->root = Concatenate(Root(), result->root);
+        return result;
+    }
+
+    Sequence<T>* Map(function<T(T)> func) override {
+        DynamicArray<Run> runs(0);
+        ForEachRun([&](const T& value, int length) {
+            AddRun(runs, func(value), length);
+        });
+        RunLengthSequence<T>* result = new RunLengthSequence<T>();
+        result->root = Build(runs, 0, runs.GetSize());
+        return result;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override {
+        return new RunLengthSequence<T>(other);
+    }
+
+    Sequence<T>* Zip(const Sequence<T>& other) const override {
+        RunLengthSequence<T>* result = new RunLengthSequence<T>();
+        int minSize = min(GetSize(), other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(Get(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    bool TryGet(int index, T& value) override {
+        if (index < 0 || index >= GetSize()) {
+            return false;
+        }
+        value = Get(index);
+        return true;
+    }
+
+    bool TryFind(function<bool(T)> predicate, T& value) override {
+        const Node* run = FindFirstRun(Root().get(), predicate);
+        if (!run) {
+            return false;
+        }
+        value = run->value;
+        return true;
+    }
+
+    T& operator[](int index) override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        if (index != pendingIndex) {
+            T value = FindRun(Root().get(), index)->value;
+            pendingIndex = index;
+            pendingValue = value;
+        }
+        return pendingValue;
+    }
+
+    const T& operator[](int index) const override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return FindRun(Root().get(), index)->value;
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new RunLengthSequence<T>(*this);
+    }
+
+protected:
+    // Sorting moves whole runs; equal runs that meet are merged.
+    void SortItems(const typename Sequence<T>::Comparator& less, bool stable) override {
+        DynamicArray<Run> runs(0);
+        ForEachRun([&](const T& value, int length) {
+            Run run;
+            run.value = value;
+            run.length = length;
+            runs.Append(run);
+        });
+        auto byValue = [&](const Run& a, const Run& b) {
+            return less(a.value, b.value);
+        };
+        if (stable) {
+            stable_sort(runs.GetData(), runs.GetData() + runs.GetSize(), byValue);
+        }
+        else {
+            sort(runs.GetData(), runs.GetData() + runs.GetSize(), byValue);
+        }
+        DynamicArray<Run> merged(0);
+        for (int i = 0; i < runs.GetSize(); ++i) {
+            AddRun(merged, runs.AtUnchecked(i).value, runs.AtUnchecked(i).length);
+        }
+        root = Build(merged, 0, merged.GetSize());
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        ForEach(visitor);
+    }
+};
+
+template <class T>
+class ListSequence : public Sequence<T> {
+protected:
+    // Copies share one list; it is duplicated on the first write. Once
+    // operator[] has handed out a reference the list is no longer shared,
+    // as a later write through it would reach the copies too.
+    shared_ptr<LinkedList<T>> list;
+    bool exposed = false;
+
+    void Detach() {
+        if (list.use_count() > 1) {
+            list = make_shared<LinkedList<T>>(*list);
+        }
+    }
+
+public:
+    ListSequence(T* items, int count) : list(make_shared<LinkedList<T>>(items, count)) {}
+
+    ListSequence() {
+        list = make_shared<LinkedList<T>>();
+    }
+
+    ListSequence(const ListSequence<T>& other)
+        : list(other.exposed ? make_shared<LinkedList<T>>(*other.list) : other.list) {}
+
+    ListSequence<T>& operator=(const ListSequence<T>& other) {
+        list = other.exposed ? make_shared<LinkedList<T>>(*other.list) : other.list;
+        exposed = false;
+        return *this;
+    }
+
+    ListSequence(const Sequence<T>& other) : list(make_shared<LinkedList<T>>()) {
+        for (int i = 0; i < other.GetSize(); ++i) {
+            list->Append(other.Get(i));
+        }
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        list->ForEach(func);
+    }
+
+    // The list is unshared first, so the cursor is not moved to another copy
+    // by a later write.
+    typename LinkedList<T>::Cursor Begin() {
+        Detach();
+        return list->Begin();
+    }
+
+    // Leaves a shared list shared; the cursor stays valid until this
+    // sequence is next written.
+    typename LinkedList<T>::Cursor Begin() const {
+        return list->Begin();
+    }
+
+    bool IsShared() const {
+        return list.use_count() > 1;
+    }
+
+    double GetFragmentation() const {
+        return list->GetFragmentation();
+    }
+
+    // Lays the nodes out in traversal order; meant for quiet periods on
+    // long-lived lists that have seen many inserts.
+    void Defragment() {
+        Detach();
+        list->Defragment();
+    }
+
+    T GetFirst() override {
+        return list->GetFirst();
+    }
+
+    T GetLast() override {
+        return list->GetLast();
+    }
+
+    T Get(int index) const override {
+        return list->Get(index);
+    }
+
+    int GetSize() const override {
+        return list->GetSize();
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= GetSize() || startIndex > endIndex)
+            throw IndexOutOfRange();
+
+        ListSequence<T>* subSequence = new ListSequence<T>();
+        for (int i = startIndex; i <= endIndex; ++i) {
+            subSequence->Append(Get(i));
+        }
+        return subSequence;
+    }
+
+    void Append(T item) override {
+        Detach();
+        list->Append(item);
+    }
+
+    void Prepend(T item) override {
+        Detach();
+        list->Prepend(item);
+    }
+
+    void Insert(T item, int index) override {
+        Detach();
+        list->Insert(item, index);
+    }
+
+    Sequence<T>* Concat(Sequence<T>* other) override {
+        ListSequence<T>* newSequence = new ListSequence<T>(*this);
+        for (int i = 0; i < other->GetSize(); ++i) {
+            newSequence->Append(other->Get(i));
+        }
+        return newSequence;
+    }
+
+    Sequence<T>* Map(function<T(T)> func) override {
+        ListSequence<T>* newSequence = new ListSequence<T>();
+        for (int i = 0; i < GetSize(); ++i) {
+            newSequence->Append(func(Get(i)));
+        }
+        return newSequence;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override {
+        Sequence<T>* result = new ListSequence<T>();
+        for (int i = 0; i < other.GetSize(); ++i) {
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    Sequence<T>* Zip(const Sequence<T>& other) const override {
+        ListSequence<T>* result = new ListSequence<T>();
+        int minSize = min(this->GetSize(), other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(this->Get(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+    
+    bool TryGet(int index, T& value) override {
+        if (index < 0 || index >= GetSize()) {
+            return false;
+        }
+        value = Get(index);
+        return true;
+    }
+
+    bool TryFind(std::function<bool(T)> predicate, T& value) override {
+        for (int i = 0; i < GetSize(); ++i) {
+            if (predicate(Get(i))) {
+                value = Get(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    T& operator[](int index) override {
+        Detach();
+        exposed = true;
+        return (*list)[index];
+    }
+
+    const T& operator[](int index) const override {
+        return (*list)[index];
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new ListSequence<T>(*this);
+    }
+
+protected:
+    // The list merge sort is always stable.
+    void SortItems(const typename Sequence<T>::Comparator& less, bool) override {
+        Detach();
+        list->Sort(less);
+    }
+
+    Sequence<T>* SelectTopK(int k, const typename Sequence<T>::Comparator& less) const override {
+        TopKCollector<T, typename Sequence<T>::Comparator> collector(k, less);
+        list->ForEach([&](const T& item) {
+            collector.Offer(item);
+        });
+        DynamicArray<T> items = collector.Take();
+        return new ArraySequence<T>(items.GetData(), items.GetSize());
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        list->ForEach(visitor);
+    }
+};
+
+template <class T>
+class MutableListSequence : public ListSequence<T> {
+public:
+    using ListSequence<T>::ListSequence;
+    MutableListSequence() : ListSequence<T>() {}
+
+    MutableListSequence(T* items, int count) : ListSequence<T>(items, count) {}
+
+    MutableListSequence(const MutableListSequence<T>& other) : ListSequence<T>(other) {}
+
+    MutableListSequence(const Sequence<T>& other) : ListSequence<T>(other) {}
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new MutableListSequence<T>(*this);
+    }
+};
+
+// Persistent list: two cons lists with shared tails, the front in order and
+// the back reversed, so Prepend and Append are O(1) and never copy. Set and
+// Insert copy only the cells in front of the position that other versions
+// still share.
+template <class T>
+class PersistentListSequence : public Sequence<T> {
+protected:
+    struct Cell;
+    typedef shared_ptr<Cell> CellPtr;
+
+    struct Cell {
+        T value;
+        CellPtr next;
+
+        Cell(const T& value, const CellPtr& next) : value(value), next(next) {}
+    };
+
+    CellPtr front;
+    CellPtr back;
+    int frontSize;
+    int backSize;
+
+    static void Release(CellPtr& cell) {
+        while (cell && cell.use_count() == 1) {
+            CellPtr next = std::move(cell->next);
+            cell = std::move(next);
+        }
+        cell.reset();
+    }
+
+    static T& Detach(CellPtr& chain, int position) {
+        CellPtr* current = &chain;
+        for (int i = 0; ; ++i) {
+            if (current->use_count() > 1) {
+                *current = make_shared<Cell>(**current);
+            }
+            if (i == position) {
+                return (*current)->value;
+            }
+            current = &(*current)->next;
+        }
+    }
+
+    static void InsertInto(CellPtr& chain, int position, const T& item) {
+        CellPtr* current = &chain;
+        for (int i = 0; i < position; ++i) {
+            if (current->use_count() > 1) {
+                *current = make_shared<Cell>(**current);
+            }
+            current = &(*current)->next;
+        }
+        *current = make_shared<Cell>(item, *current);
+    }
+
+    static const Cell* Walk(const Cell* cell, int steps) {
+        for (int i = 0; i < steps; ++i) {
+            cell = cell->next.get();
+        }
+        return cell;
+    }
+
+    const Cell* FindCell(int index) const {
+        if (index < frontSize) {
+            return Walk(front.get(), index);
+        }
+        return Walk(back.get(), backSize - 1 - (index - frontSize));
+    }
+
+public:
+    PersistentListSequence() : frontSize(0), backSize(0) {}
+
+    PersistentListSequence(T* items, int count) : PersistentListSequence() {
+        for (int i = count - 1; i >= 0; --i) {
+            Prepend(items[i]);
+        }
+    }
+
+    PersistentListSequence(const PersistentListSequence<T>& other)
+        : front(other.front), back(other.back), frontSize(other.frontSize), backSize(other.backSize) {}
+
+    PersistentListSequence(const Sequence<T>& other) : PersistentListSequence() {
+        for (int i = 0; i < other.GetSize(); ++i) {
+            Append(other.Get(i));
+        }
+    }
+
+    ~PersistentListSequence() {
+        Release(front);
+        Release(back);
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        ForEachWhile([&](const T& item) {
+            func(item);
+            return true;
+        });
+    }
+
+    // Like ForEach, but stops as soon as func returns false.
+    template <class Func>
+    void ForEachWhile(Func func) const {
+        for (const Cell* cell = front.get(); cell != nullptr; cell = cell->next.get()) {
+            if (!func(cell->value)) {
+                return;
+            }
+        }
+        if (backSize == 0) {
+            return;
+        }
+        DynamicArray<const Cell*> reversed(backSize);
+        int position = backSize;
+        for (const Cell* cell = back.get(); cell != nullptr; cell = cell->next.get()) {
+            reversed.AtUnchecked(--position) = cell;
+        }
+        for (int i = 0; i < backSize; ++i) {
+            if (!func(reversed.AtUnchecked(i)->value)) {
+                return;
+            }
+        }
+    }
+
+    T GetFirst() override {
+        if (GetSize() == 0) throw IndexOutOfRange();
+        return FindCell(0)->value;
+    }
+
+    T GetLast() override {
+        if (GetSize() == 0) throw IndexOutOfRange();
+        return FindCell(GetSize() - 1)->value;
+    }
+
+    T Get(int index) const override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return FindCell(index)->value;
+    }
+
+    int GetSize() const override {
+        return frontSize + backSize;
+    }
+
+    void Set(int index, T item) {
+        (*this)[index] = item;
+    }
+
+    void Append(T item) override {
+        back = make_shared<Cell>(item, back);
+        backSize++;
+    }
+
+    void Prepend(T item) override {
+        front = make_shared<Cell>(item, front);
+        frontSize++;
+    }
+
+    void Insert(T item, int index) override {
+        if (index < 0 || index > GetSize()) throw IndexOutOfRange();
+        if (index <= frontSize) {
+            InsertInto(front, index, item);
+            frontSize++;
+        }
+        else {
+            InsertInto(back, backSize - (index - frontSize), item);
+            backSize++;
+        }
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= GetSize() || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        PersistentListSequence<T>* subSequence = new PersistentListSequence<T>();
+        int index = 0;
+        ForEach([&](const T& item) {
+            if (index >= startIndex && index <= endIndex) {
+                subSequence->Append(item);
+            }
+            ++index;
+        });
+        return subSequence;
+    }
+
+    Sequence<T>* Concat(Sequence<T>* other) override {
+        PersistentListSequence<T>* result = new PersistentListSequence<T>(*this);
+        for (int i = 0; i < other->GetSize(); ++i) {
+            result->Append(other->Get(i));
+        }
+        return result;
+    }
+
+    Sequence<T>* Map(function<T(T)> func) override {
+        PersistentListSequence<T>* result = new PersistentListSequence<T>();
+        ForEach([&](const T& item) {
+            result->Append(func(item));
+        });
+        return result;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override {
+        return new PersistentListSequence<T>(other);
+    }
+
+    Sequence<T>* Zip(const Sequence<T>& other) const override {
+        PersistentListSequence<T>* result = new PersistentListSequence<T>();
+        int minSize = min(this->GetSize(), other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(this->Get(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    bool TryGet(int index, T& value) override {
+        if (index < 0 || index >= GetSize()) {
+            return false;
+        }
+        value = FindCell(index)->value;
+        return true;
+    }
+
+    bool TryFind(function<bool(T)> predicate, T& value) override {
+        bool found = false;
+        ForEachWhile([&](const T& item) {
+            if (predicate(item)) {
+                value = item;
+                found = true;
+            }
+            return !found;
+        });
+        return found;
+    }
+
+    T& operator[](int index) override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        if (index < frontSize) {
+            return Detach(front, index);
+        }
+        return Detach(back, backSize - 1 - (index - frontSize));
+    }
+
+    const T& operator[](int index) const override {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return FindCell(index)->value;
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new PersistentListSequence<T>(*this);
+    }
+
+protected:
+    void SortItems(const typename Sequence<T>::Comparator& less, bool stable) override {
+        int size = GetSize();
+        DynamicArray<T> items(size);
+        int position = 0;
+        ForEach([&](const T& item) {
+            items.AtUnchecked(position++) = item;
+        });
+        SortBuffer(items.GetData(), size, less, stable);
+        Release(front);
+        Release(back);
+        frontSize = backSize = 0;
+        for (int i = size - 1; i >= 0; --i) {
+            Prepend(items.AtUnchecked(i));
+        }
+    }
+
+    Sequence<T>* SelectTopK(int k, const typename Sequence<T>::Comparator& less) const override {
+        TopKCollector<T, typename Sequence<T>::Comparator> collector(k, less);
+        ForEach([&](const T& item) {
+            collector.Offer(item);
+        });
+        DynamicArray<T> items = collector.Take();
+        return new ArraySequence<T>(items.GetData(), items.GetSize());
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        ForEach(visitor);
+    }
+};
+
+template <class T>
+class ImmutableListSequence : public PersistentListSequence<T> {
+public:
+    using PersistentListSequence<T>::PersistentListSequence;
+
+    ImmutableListSequence(const ImmutableListSequence<T>& other) : PersistentListSequence<T>(other) {}
+
+    Sequence<T>* Instance() override {
+        return this->Clone();
+    }
+
+    Sequence<T>* Clone() const override {
+        return new ImmutableListSequence<T>(*this);
+    }
+};
+
+// Circular buffer: O(1) Get, Append and Prepend; Insert shifts the
+// shorter side of the ring.
+template <class T>
+class RingSequence : public Sequence<T> {
+protected:
+    DynamicArray<T> ring;
+    int head;
+    int count;
+
+    int Slot(int index) const {
+        return (head + index) & (ring.GetSize() - 1);
+    }
+
+    void GrowIfFull() {
+        if (count < ring.GetSize()) {
+            return;
+        }
+        DynamicArray<T> grown(ring.GetSize() == 0 ? 8 : ring.GetSize() * 2);
+        for (int i = 0; i < count; ++i) {
+            grown.AtUnchecked(i) = ring.GetUnchecked(Slot(i));
+        }
+        ring = grown;
+        head = 0;
+    }
+
+public:
+    RingSequence() : head(0), count(0) {}
+
+    RingSequence(T* items, int count) : RingSequence() {
+        for (int i = 0; i < count; ++i) {
+            Append(items[i]);
+        }
+    }
+
+    RingSequence(const Sequence<T>& other) : RingSequence() {
+        for (int i = 0; i < other.GetSize(); ++i) {
+            Append(other.Get(i));
+        }
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        for (int i = 0; i < count; ++i) {
+            func(ring.AtUnchecked(Slot(i)));
+        }
+    }
+
+    T GetFirst() override {
+        if (count == 0) throw IndexOutOfRange();
+        return ring.GetUnchecked(Slot(0));
+    }
+
+    T GetLast() override {
+        if (count == 0) throw IndexOutOfRange();
+        return ring.GetUnchecked(Slot(count - 1));
+    }
+
+    T Get(int index) const override {
+        if (index < 0 || index >= count) throw IndexOutOfRange();
+        return ring.GetUnchecked(Slot(index));
+    }
+
+    int GetSize() const override {
+        return count;
+    }
+
+    void Append(T item) override {
+        GrowIfFull();
+        ring.AtUnchecked(Slot(count)) = item;
+        count++;
+    }
+
+    void Prepend(T item) override {
+        GrowIfFull();
+        head = (head - 1) & (ring.GetSize() - 1);
+        ring.AtUnchecked(head) = item;
+        count++;
+    }
+
+    void Insert(T item, int index) override {
+        if (index < 0 || index > count) throw IndexOutOfRange();
+        GrowIfFull();
+        if (index < count / 2) {
+            head = (head - 1) & (ring.GetSize() - 1);
+            for (int i = 0; i < index; ++i) {
+                ring.AtUnchecked(Slot(i)) = ring.GetUnchecked(Slot(i + 1));
+            }
+        }
+        else {
+            for (int i = count; i > index; --i) {
+                ring.AtUnchecked(Slot(i)) = ring.GetUnchecked(Slot(i - 1));
+            }
+        }
+        ring.AtUnchecked(Slot(index)) = item;
+        count++;
+    }
+
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= count || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        RingSequence<T>* subSequence = new RingSequence<T>();
+        for (int i = startIndex; i <= endIndex; ++i) {
+            subSequence->Append(ring.GetUnchecked(Slot(i)));
         }
         return subSequence;
     }
 
+    Sequence<T>* Concat(Sequence<T>* other) override {
+        RingSequence<T>* result = new RingSequence<T>(*this);
+        for (int i = 0; i < other->GetSize(); ++i) {
+            result->Append(other->Get(i));
+        }
+        return result;
+    }
+
+    Sequence<T>* Map(function<T(T)> func) override {
+        RingSequence<T>* result = new RingSequence<T>();
+        ForEach([&](const T& item) {
+            result->Append(func(item));
+        });
+        return result;
+    }
+
+    Sequence<T>* From(const Sequence<T>& other) override {
+        return new RingSequence<T>(other);
+    }
+
+    Sequence<T>* Zip(const Sequence<T>& other) const override {
+        RingSequence<T>* result = new RingSequence<T>();
+        int minSize = min(this->GetSize(), other.GetSize());
+        for (int i = 0; i < minSize; ++i) {
+            result->Append(this->Get(i));
+            result->Append(other.Get(i));
+        }
+        return result;
+    }
+
+    bool TryGet(int index, T& value) override {
+        if (index < 0 || index >= count) {
+            return false;
+        }
+        value = ring.GetUnchecked(Slot(index));
+        return true;
+    }
+
+    bool TryFind(function<bool(T)> predicate, T& value) override {
+        for (int i = 0; i < count; ++i) {
+            if (predicate(ring.GetUnchecked(Slot(i)))) {
+                value = ring.GetUnchecked(Slot(i));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    T& operator[](int index) override {
+        if (index < 0 || index >= count) throw IndexOutOfRange();
+        return ring.AtUnchecked(Slot(index));
+    }
+
+    const T& operator[](int index) const override {
+        if (index < 0 || index >= count) throw IndexOutOfRange();
+        return ring.AtUnchecked(Slot(index));
+    }
+
+    Sequence<T>* Instance() override {
+        return this;
+    }
+
+    Sequence<T>* Clone() const override {
+        return new RingSequence<T>(*this);
+    }
+
+protected:
+    void Visit(const function<void(const T&)>& visitor) const override {
+        ForEach(visitor);
+    }
+};
+
+// Segments are fixed blocks of SegmentBytes holding their elements inline.
+// Append, Prepend, Compact and Sort fill them to capacity, so a list built
+// that way costs little more than its elements. The tuned segment size is
+// the split threshold for inserts in the middle: a segment holding that
+// many first hands an element to a neighbour below it and is otherwise
+// split in half, so segments where inserts land settle between half the
+// tuned size and the tuned size, while the rest stay dense. Nothing
+// removes elements, so no segment underflows further.
+template <class T, class Checking = AlwaysCheckBounds, int SegmentBytes = 1024>
+class SegmentedList final : public Sequence<T> {
+private:
+    enum { Capacity = SegmentBytes / static_cast<int>(sizeof(T)) > 4 ? SegmentBytes / static_cast<int>(sizeof(T)) : 4 };
+
+    struct Segment {
+        int count;
+        // The list's epoch when the segment was last known to be private.
+        uint64_t epoch;
+        // operator[] handed out a reference into it; see ShareableSegments.
+        bool exposed;
+        T items[Capacity];
+
+        Segment() : count(0), epoch(0), exposed(false) {}
+    };
+
+    typedef shared_ptr<Segment> SegmentPtr;
+
+    // Clones share the table and the segments. A writer unshares the table,
+    // which only copies segment pointers, and then the one segment it writes.
+    DynamicArray<SegmentPtr> segments;
+    int size;
+    int segmentSize;
+    unique_ptr<SequenceIndex<T>> hashIndex;
+    mutable uint64_t epoch = 0;
+    // Some segment may be exposed.
+    bool exposed = false;
+
+    const Segment& SegmentAt(int segmentIndex) const {
+        return *segments.AtUnchecked(segmentIndex);
+    }
+
+    // Applies a pending write through operator[] to the index.
+    void SettleIndex() const {
+        if (hashIndex) {
+            hashIndex->Settle([this](int position) {
+                return Get(position);
+            });
+        }
+    }
+
+    // A segment older than the last Snapshot may have been read through a
+    // view; once it is ours alone, one fence orders the write after those
+    // reads, and the segment is stamped so later writes skip it.
+    Segment& WritableSegment(int segmentIndex) {
+        SegmentPtr& segment = segments.AtUnchecked(segmentIndex);
+        if (segment.use_count() > 1) {
+            segment = make_shared<Segment>(*segment);
+            segment->epoch = epoch;
+            segment->exposed = false;
+        }
+        else if (segment->epoch != epoch) {
+            atomic_thread_fence(memory_order_acquire);
+            segment->epoch = epoch;
+        }
+        return *segment;
+    }
+
+    int FindSegment(int index, int& position) const {
+        if (Checking::Enabled && (index < 0 || index >= size)) throw IndexOutOfRange();
+
+        int currentPos = 0;
+        int last = segments.GetSize() - 1;
+        for (int i = 0; i < last; i++) {
+            int count = SegmentAt(i).count;
+            if (index < currentPos + count) {
+                position = index - currentPos;
+                return i;
+            }
+            currentPos += count;
+        }
+        position = index - currentPos;
+        return last;
+    }
+
+    // The table to hand to a copy. A segment that a reference from
+    // operator[] may still be written through is copied rather than shared,
+    // so the write cannot reach the copy.
+    DynamicArray<SegmentPtr> ShareableSegments() const {
+        if (!exposed) {
+            return segments;
+        }
+        DynamicArray<SegmentPtr> table(segments.GetSize());
+        for (int i = 0; i < segments.GetSize(); ++i) {
+            const SegmentPtr& segment = segments.AtUnchecked(i);
+            if (segment->exposed) {
+                table.AtUnchecked(i) = make_shared<Segment>(*segment);
+                table.AtUnchecked(i)->exposed = false;
+            }
+            else {
+                table.AtUnchecked(i) = segment;
+            }
+        }
+        return table;
+    }
+
+    static void InsertInto(Segment& segment, int position, const T& item) {
+        for (int i = segment.count; i > position; --i) {
+            segment.items[i] = segment.items[i - 1];
+        }
+        segment.items[position] = item;
+        segment.count++;
+    }
+
+    static T RemoveFirst(Segment& segment) {
+        T item = segment.items[0];
+        for (int i = 1; i < segment.count; ++i) {
+            segment.items[i - 1] = segment.items[i];
+        }
+        segment.count--;
+        return item;
+    }
+
+public:
+    // Read-only view of the elements as of one epoch; see Snapshot.
+    class View {
+    private:
+        DynamicArray<SegmentPtr> segments;
+        int size;
+        uint64_t epoch;
+
+    public:
+        View(const DynamicArray<SegmentPtr>& segments, int size, uint64_t epoch)
+            : segments(segments), size(size), epoch(epoch) {}
+
+        uint64_t GetEpoch() const {
+            return epoch;
+        }
+
+        int GetSize() const {
+            return size;
+        }
+
+        const T& operator[](int index) const {
+            if (index < 0 || index >= size) throw IndexOutOfRange();
+            for (int i = 0;; ++i) {
+                const Segment& segment = *segments.AtUnchecked(i);
+                if (index < segment.count) {
+                    return segment.items[index];
+                }
+                index -= segment.count;
+            }
+        }
+
+        T Get(int index) const {
+            return (*this)[index];
+        }
+
+        template <class Func>
+        void ForEach(Func func) const {
+            for (int i = 0; i < segments.GetSize(); ++i) {
+                const Segment& segment = *segments.AtUnchecked(i);
+                for (int j = 0; j < segment.count; ++j) {
+                    func(segment.items[j]);
+                }
+            }
+        }
+    };
+
+    SegmentedList() : size(0), segmentSize(min(static_cast<int>(Capacity), SequenceTuning<T>::GetSegmentSize())) {}
+
+    SegmentedList(T* items, int count) : SegmentedList() {
+        for (int i = 0; i < count; i++) {
+            Append(items[i]);
+        }
+    }
+
+    SegmentedList(const SegmentedList<T, Checking, SegmentBytes>& other)
+        : segments(other.ShareableSegments()), size(other.size), segmentSize(other.segmentSize),
+          hashIndex(other.hashIndex ? other.hashIndex->Clone() : nullptr) {}
+
+    static int GetSegmentCapacity() {
+        return Capacity;
+    }
+
+    // Split threshold for inserts in the middle; see the class comment.
+    int GetSegmentSize() const {
+        return segmentSize;
+    }
+
+    int GetSegmentCount() const {
+        return segments.GetSize();
+    }
+
+    // O(1) view stamped with the current epoch, which then advances. The
+    // view shares the segment table and the segments; the writer copies the
+    // table (only pointers) and then just the segments it changes, and a
+    // segment is freed with the last view using it. Take snapshots on the
+    // writer's thread; the views can be read on any thread meanwhile.
+    // Segments written through a reference from operator[] are copied into
+    // the view rather than shared.
+    View Snapshot() const {
+        segments.Publish();
+        return View(ShareableSegments(), size, epoch++);
+    }
+
+    // Epoch the writes made now belong to.
+    uint64_t GetEpoch() const {
+        return epoch;
+    }
+
+    // Sizes the segment table for count elements; segments are still
+    // allocated as they fill.
+    void Reserve(int count) {
+        segments.Reserve((count + Capacity - 1) / Capacity);
+    }
+
+    // Share of the allocated segment slots that hold elements.
+    double GetFillFactor() const {
+        if (segments.GetSize() == 0) {
+            return 1.0;
+        }
+        return static_cast<double>(size) / (static_cast<double>(segments.GetSize()) * Capacity);
+    }
+
+    // Repacks every segment to capacity.
+    void Compact() {
+        DynamicArray<SegmentPtr> packed;
+        ForEach([&](const T& item) {
+            if (packed.GetSize() == 0 || packed.GetUnchecked(packed.GetSize() - 1)->count >= Capacity) {
+                packed.Append(make_shared<Segment>());
+            }
+            Segment& segment = *packed.AtUnchecked(packed.GetSize() - 1);
+            segment.items[segment.count++] = item;
+        });
+        segments = packed;
+    }
+
+    // See ArraySequence::AttachIndex.
+    void AttachIndex() {
+        if (!hashIndex) {
+            hashIndex.reset(new HashIndex<T>());
+        }
+    }
+
+    void DetachIndex() {
+        hashIndex.reset();
+    }
+
+    bool HasIndex() const {
+        return hashIndex != nullptr;
+    }
+
+    // See ArraySequence::IndexOf; not safe for concurrent callers while an
+    // index is attached.
+    int IndexOf(const T& value) const {
+        if (hashIndex) {
+            SettleIndex();
+            hashIndex->Refresh([this](auto func) {
+                ForEach(func);
+            });
+            return hashIndex->Find(value);
+        }
+        int index = 0;
+        int found = -1;
+        ForEach([&](const T& item) {
+            if (found == -1 && item == value) {
+                found = index;
+            }
+            index++;
+        });
+        return found;
+    }
+
+    bool Contains(const T& value) const {
+        return IndexOf(value) != -1;
+    }
+
+    void Set(int index, T value) {
+        SettleIndex();
+        int position;
+        int segmentIndex = FindSegment(index, position);
+        T& slot = WritableSegment(segmentIndex).items[position];
+        if (hashIndex) {
+            hashIndex->Replaced(slot, value, index);
+        }
+        slot = value;
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        for (int i = 0; i < segments.GetSize(); ++i) {
+            const Segment& segment = SegmentAt(i);
+            for (int j = 0; j < segment.count; ++j) {
+                func(segment.items[j]);
+            }
+        }
+    }
+
+    T GetFirst() override {
+        if (size == 0) throw IndexOutOfRange();
+        return SegmentAt(0).items[0];
+    }
+
+    T GetLast() override {
+        if (size == 0) throw IndexOutOfRange();
+        const Segment& lastSegment = SegmentAt(segments.GetSize() - 1);
+        return lastSegment.items[lastSegment.count - 1];
+    }
+
+    T Get(int index) const override {
+        int position;
+        int segmentIndex = FindSegment(index, position);
+        return SegmentAt(segmentIndex).items[position];
+    }
+
+    int GetSize() const override {
+        return size;
+    }
+
     void Append(T item) override {
-        array->Append(item);
+        int last = segments.GetSize() - 1;
+        if (last < 0 || SegmentAt(last).count >= Capacity) {
+            segments.Append(make_shared<Segment>());
+            last++;
+        }
+        Segment& segment = WritableSegment(last);
+        segment.items[segment.count++] = item;
+        size++;
+        if (hashIndex) {
+            hashIndex->Add(item, size - 1);
+        }
     }
 
     void Prepend(T item) override {
-        array->Prepend(item);
+        SettleIndex();
+        if (segments.GetSize() == 0 || SegmentAt(0).count >= Capacity) {
+            segments.Prepend(make_shared<Segment>());
+        }
+        InsertInto(WritableSegment(0), 0, item);
+        size++;
+        if (hashIndex) {
+            hashIndex->AddFront(item);
+        }
     }
 
     void Insert(T item, int index) override {
-        array->Insert(item, index);
+        if (index < 0 || index > size) {
+            throw IndexOutOfRange();
+        }
+
+        if (index == 0) {
+            Prepend(item);
+            return;
+        }
+        if (index == size) {
+            Append(item);
+            return;
+        }
+
+        int posInSegment;
+        int segmentIndex = FindSegment(index, posInSegment);
+        size++;
+        if (hashIndex) {
+            hashIndex->Invalidate();
+        }
+
+        if (SegmentAt(segmentIndex).count < segmentSize) {
+            InsertInto(WritableSegment(segmentIndex), posInSegment, item);
+            return;
+        }
+
+        Segment& segment = WritableSegment(segmentIndex);
+        if (segmentIndex + 1 < segments.GetSize() && SegmentAt(segmentIndex + 1).count < segmentSize) {
+            Segment& next = WritableSegment(segmentIndex + 1);
+            InsertInto(next, 0, segment.items[segment.count - 1]);
+            segment.count--;
+            InsertInto(segment, posInSegment, item);
+            return;
+        }
+        if (segmentIndex > 0 && SegmentAt(segmentIndex - 1).count < segmentSize) {
+            Segment& previous = WritableSegment(segmentIndex - 1);
+            if (posInSegment == 0) {
+                previous.items[previous.count++] = item;
+                return;
+            }
+            previous.items[previous.count++] = RemoveFirst(segment);
+            InsertInto(segment, posInSegment - 1, item);
+            return;
+        }
+
+        SegmentPtr upper = make_shared<Segment>();
+        int splitPos = segment.count / 2;
+        for (int i = splitPos; i < segment.count; ++i) {
+            upper->items[upper->count++] = segment.items[i];
+        }
+        segment.count = splitPos;
+        segments.Insert(upper, segmentIndex + 1);
+
+        if (posInSegment >= splitPos) {
+            InsertInto(*upper, posInSegment - splitPos, item);
+        }
+        else {
+            InsertInto(segment, posInSegment, item);
+        }
     }
 
-    Sequence<T>* Concat(Sequence<T>* list) override {
-        ArraySequence<T>* newSequence = new ArraySequence<T>(*this);
-        for (int i = 0; i < list->GetSize(); ++i) {
-            newSequence->Append(list->Get(i));
+    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
+        if (startIndex < 0 || endIndex >= size || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        SegmentedList<T, Checking, SegmentBytes>* subList = new SegmentedList<T, Checking, SegmentBytes>();
+        int index = 0;
+        ForEach([&](const T& item) {
+            if (index >= startIndex && index <= endIndex) {
+                subList->Append(item);
+            }
+            index++;
+        });
+        return subList;
+    }
+
+    Sequence<T>* Concat(Sequence<T>* other) override {
+        SegmentedList<T, Checking, SegmentBytes>* result = new SegmentedList<T, Checking, SegmentBytes>(*this);
+        for (int i = 0; i < other->GetSize(); i++) {
+            result->Append(other->Get(i));
         }
-        return newSequence;
+        return result;
     }
 
     Sequence<T>* Map(function<T(T)> func) override {
-        ArraySequence<T>* newSequence = new ArraySequence<T>();
-        for (int i = 0; i < array->GetSize(); ++i) {
-            newSequence->Append(func(array->Get(i)));
-        }
-        return newSequence;
+        SegmentedList<T, Checking, SegmentBytes>* result = new SegmentedList<T, Checking, SegmentBytes>();
+        ForEach([&](const T& item) {
+            result->Append(func(item));
+        });
+        return result;
     }
 
-    Sequence<T>* From(const Sequence<T>& other) override{
-        Sequence<T>* result = new ArraySequence<T>();
+    Sequence<T>* From(const Sequence<T>& other) {
+        Sequence<T>* result = new SegmentedList<T, Checking, SegmentBytes>();
         for (int i = 0; i < other.GetSize(); ++i) {
             result->Append(other.Get(i));
         }
         return result;
     }
-    
-    // Tuple<T,T> == Pair<T>
-    // zip: Tuple<Sequence<T>, Sequence<T>> -> Sequence<Tuple<T,T>>
-    // unzip: Sequence<Tuple<T,T>> -> Tuple<Sequence<T>, Sequence<T>>
 
     Sequence<T>* Zip(const Sequence<T>& other) const override {
-        ArraySequence<T>* result = new ArraySequence<T>();
+        SegmentedList<T, Checking, SegmentBytes>* result = new SegmentedList<T, Checking, SegmentBytes>();
         int minSize = min(this->GetSize(), other.GetSize());
         for (int i = 0; i < minSize; ++i) {
             result->Append(this->Get(i));
@@ -443,37 +6388,45 @@ public:
         return result;
     }
 
-    //Optional<T> TryGet(int index) override {
-    //    if (index < 0 || index >= array->GetSize()) {
-    //        return Optional::None();
-    //    }
-    //    auto value = array->Get(index);
-    //    return Optional<T>(value);
-    //}
     bool TryGet(int index, T& value) override {
-        if (index < 0 || index >= array->GetSize()) {
+        if (index < 0 || index >= GetSize()) {
             return false;
         }
-        value = array->Get(index);
+        value = Get(index);
         return true;
     }
 
     bool TryFind(std::function<bool(T)> predicate, T& value) override {
-        for (int i = 0; i < array->GetSize(); i++) {
-            if (predicate(array->Get(i))) {
-                value = array->Get(i);
-                return true;
+        for (int i = 0; i < segments.GetSize(); ++i) {
+            const Segment& segment = SegmentAt(i);
+            for (int j = 0; j < segment.count; ++j) {
+                if (predicate(segment.items[j])) {
+                    value = segment.items[j];
+                    return true;
+                }
             }
         }
         return false;
     }
 
     T& operator[](int index) override {
-        return (*array)[index];
+        if (hashIndex) {
+            hashIndex->Writing(index, [this](int position) {
+                return Get(position);
+            });
+        }
+        int position;
+        int segmentIndex = FindSegment(index, position);
+        Segment& segment = WritableSegment(segmentIndex);
+        segment.exposed = true;
+        exposed = true;
+        return segment.items[position];
     }
 
     const T& operator[](int index) const override {
-        return (*array)[index];
+        int position;
+        int segmentIndex = FindSegment(index, position);
+        return SegmentAt(segmentIndex).items[position];
     }
 
     Sequence<T>* Instance() override {
@@ -481,302 +6434,757 @@ public:
     }
 
     Sequence<T>* Clone() const override {
-        ArraySequence<T>* clone = new ArraySequence<T>();
-        for (int i = 0; i < this->GetSize(); ++i) {
-            clone->Append(this->Get(i));
+        return new SegmentedList<T, Checking, SegmentBytes>(*this);
+    }
+
+protected:
+    // Sorts every segment on its own, then k-way merges the segments into a
+    // freshly packed table. Ties go to the earlier segment, which keeps the
+    // merge stable.
+    void SortItems(const typename Sequence<T>::Comparator& less, bool stable) override {
+        int count = segments.GetSize();
+        for (int i = 0; i < count; ++i) {
+            WritableSegment(i);
+        }
+        int threads = GetSortThreads(size);
+        ParallelFor(threads, [&](int worker) {
+            for (int i = worker; i < count; i += threads) {
+                Segment& segment = *segments.AtUnchecked(i);
+                SortBuffer(segment.items, segment.count, less, stable);
+            }
+        });
+
+        DynamicArray<int> positions(count);
+        DynamicArray<int> heap(0);
+        for (int i = 0; i < count; ++i) {
+            positions.AtUnchecked(i) = 0;
+            if (SegmentAt(i).count > 0) {
+                heap.Append(i);
+            }
+        }
+        auto after = [&](int a, int b) {
+            const T& x = SegmentAt(a).items[positions.AtUnchecked(a)];
+            const T& y = SegmentAt(b).items[positions.AtUnchecked(b)];
+            if (less(y, x)) {
+                return true;
+            }
+            if (less(x, y)) {
+                return false;
+            }
+            return a > b;
+        };
+        int* heapBegin = heap.GetData();
+        int heapSize = heap.GetSize();
+        make_heap(heapBegin, heapBegin + heapSize, after);
+
+        DynamicArray<SegmentPtr> merged;
+        while (heapSize > 0) {
+            pop_heap(heapBegin, heapBegin + heapSize, after);
+            int source = heapBegin[heapSize - 1];
+            if (merged.GetSize() == 0 || merged.GetUnchecked(merged.GetSize() - 1)->count >= Capacity) {
+                merged.Append(make_shared<Segment>());
+            }
+            Segment& target = *merged.AtUnchecked(merged.GetSize() - 1);
+            int& position = positions.AtUnchecked(source);
+            target.items[target.count++] = SegmentAt(source).items[position++];
+            if (position < SegmentAt(source).count) {
+                push_heap(heapBegin, heapBegin + heapSize, after);
+            }
+            else {
+                heapSize--;
+            }
         }
-        return clone;
+        segments = merged;
+        if (hashIndex) {
+            hashIndex->Invalidate();
+        }
+    }
+
+    Sequence<T>* SelectTopK(int k, const typename Sequence<T>::Comparator& less) const override {
+        DynamicArray<T> items = ParallelTopK<T>(k, less, size, segments.GetSize(), [&](int segmentIndex, TopKCollector<T, typename Sequence<T>::Comparator>& collector) {
+            const Segment& segment = SegmentAt(segmentIndex);
+            for (int i = 0; i < segment.count; ++i) {
+                collector.Offer(segment.items[i]);
+            }
+        });
+        return new ArraySequence<T>(items.GetData(), items.GetSize());
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        ForEach(visitor);
     }
 };
 
+inline int FloorLog2(unsigned value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return static_cast<int>(index);
+#else
+    return 31 - __builtin_clz(value);
+#endif
+}
+
+// Append-only list safe for any number of appending and reading threads
+// without locks. Segment k holds FirstSegment << k elements, so an index
+// finds its segment with one bit scan and segments never move. Append
+// copies the item, makes sure the segment of the next free index exists and
+// only then claims that index with compare-and-swap, so nothing that can
+// throw runs while an index is reserved; it then writes the element and
+// marks it ready. The size readers see is a watermark covering the ready
+// prefix, which every appender helps to advance. Get is wait-free for
+// indices below it.
 template <class T>
-class MutableArraySequence : public ArraySequence<T> {
-public:
-    using ArraySequence<T>::ArraySequence;
+class ConcurrentSegmentedList {
+private:
+    enum { FirstShift = 6, FirstSegment = 1 << FirstShift, MaxSegments = 32 };
 
-    MutableArraySequence() : ArraySequence<T>() {}
+    struct Segment {
+        unique_ptr<T[]> items;
+        unique_ptr<atomic<bool>[]> ready;
 
-    MutableArraySequence(T* items, int count) : ArraySequence<T>(items, count) {}
+        explicit Segment(int capacity) : items(new T[capacity]), ready(new atomic<bool>[capacity]()) {}
+    };
 
-    MutableArraySequence(const MutableArraySequence<T>& other) : ArraySequence<T>(other) {}
+    atomic<Segment*> segments[MaxSegments];
+    atomic<int> reserved;
+    atomic<int> published;
 
-    MutableArraySequence(const Sequence<T>& other) : ArraySequence<T>(other) {}
+    static int SegmentOf(int index, int& position) {
+        int segment = FloorLog2(static_cast<unsigned>(index >> FirstShift) + 1);
+        position = index - (((1 << segment) - 1) << FirstShift);
+        return segment;
+    }
 
-    Sequence<T>* Instance() {
-        return this;
+    // Threads that find a segment missing each allocate one and race to
+    // install it; the losers free theirs. The rare double allocation at a
+    // boundary is the price of never waiting on another appender.
+    Segment* Acquire(int segmentIndex) {
+        Segment* segment = segments[segmentIndex].load(memory_order_acquire);
+        if (segment) {
+            return segment;
+        }
+        Segment* created = new Segment(FirstSegment << segmentIndex);
+        if (segments[segmentIndex].compare_exchange_strong(segment, created, memory_order_acq_rel)) {
+            return created;
+        }
+        delete created;
+        return segment;
     }
 
-    Sequence<T>* Clone() const {
-        return new MutableArraySequence<T>(*this);
+    bool IsReady(int index) const {
+        int position;
+        int segmentIndex = SegmentOf(index, position);
+        Segment* segment = segments[segmentIndex].load(memory_order_acquire);
+        return segment && segment->ready[position].load();
+    }
+
+    void AdvanceWatermark() {
+        int current = published.load();
+        while (current < reserved.load() && IsReady(current)) {
+            if (published.compare_exchange_weak(current, current + 1)) {
+                ++current;
+            }
+        }
+    }
+
+    const T& At(int index) const {
+        int position;
+        int segmentIndex = SegmentOf(index, position);
+        return segments[segmentIndex].load(memory_order_acquire)->items[position];
     }
-};
 
-template <class T>
-class ImmutableArraySequence : public ArraySequence<T> {
 public:
-    using ArraySequence<T>::ArraySequence;
+    ConcurrentSegmentedList() : reserved(0), published(0) {
+        for (int i = 0; i < MaxSegments; ++i) {
+            segments[i].store(nullptr, memory_order_relaxed);
+        }
+    }
 
-    ImmutableArraySequence(const ImmutableArraySequence<T>& other) : ArraySequence<T>(other) {}
+    ConcurrentSegmentedList(const ConcurrentSegmentedList<T>&) = delete;
+    ConcurrentSegmentedList<T>& operator=(const ConcurrentSegmentedList<T>&) = delete;
 
-    Sequence<T>* Instance() override {
-        return this->Clone();
+    ~ConcurrentSegmentedList() {
+        for (int i = 0; i < MaxSegments; ++i) {
+            delete segments[i].load(memory_order_relaxed);
+        }
     }
 
-    Sequence<T>* Clone() const override {
-        return new ImmutableArraySequence<T>(*this);
+    // Returns the index the item went to; it is visible to Get once every
+    // earlier append has finished too. Should moving the copy into place
+    // throw, the index keeps a default-constructed element so that later
+    // appends still become visible.
+    int Append(const T& item) {
+        T value(item);
+        int index = reserved.load(memory_order_relaxed);
+        int position;
+        Segment* segment;
+        do {
+            if (index < 0 || index > INT_MAX - FirstSegment) {
+                throw IndexOutOfRange();
+            }
+            segment = Acquire(SegmentOf(index, position));
+        } while (!reserved.compare_exchange_weak(index, index + 1, memory_order_relaxed));
+        try {
+            segment->items[position] = std::move(value);
+        }
+        catch (...) {
+            segment->ready[position].store(true);
+            AdvanceWatermark();
+            throw;
+        }
+        segment->ready[position].store(true);
+        AdvanceWatermark();
+        return index;
     }
-};
 
-template <class T>
-class ListSequence : public Sequence<T> {
-protected:
-    LinkedList<T>* list;
-public:
-    ListSequence(T* items, int count) : list(new LinkedList<T>(items, count)) {}
+    // Elements below the watermark; they never change after publication.
+    int GetSize() const {
+        return published.load(memory_order_acquire);
+    }
 
-    ListSequence() {
-        list = new LinkedList<T>();
+    T Get(int index) const {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return At(index);
     }
 
-    ListSequence(const Sequence<T>& other) : list(new LinkedList<T>()) {
-        for (int i = 0; i < other.GetSize(); ++i) {
-            list->Append(other.Get(i));
+    bool TryGet(int index, T& value) const {
+        if (index < 0 || index >= GetSize()) {
+            return false;
         }
+        value = At(index);
+        return true;
     }
 
-    ~ListSequence() {
-        delete list;
+    const T& operator[](int index) const {
+        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+        return At(index);
+    }
+
+    // Visits the elements published when the call starts.
+    template <class Func>
+    void ForEach(Func func) const {
+        int size = GetSize();
+        int segmentIndex = 0;
+        for (long long first = 0; first < size; first += FirstSegment << segmentIndex, ++segmentIndex) {
+            const T* items = segments[segmentIndex].load(memory_order_acquire)->items.get();
+            int count = static_cast<int>(min<long long>(FirstSegment << segmentIndex, size - first));
+            for (int i = 0; i < count; ++i) {
+                func(items[i]);
+            }
+        }
     }
 
-    T GetFirst() override {
-        return list->GetFirst();
+    // Copies the published prefix into an ordinary sequence.
+    ArraySequence<T>* Snapshot() const {
+        ArraySequence<T>* result = new ArraySequence<T>();
+        result->Reserve(GetSize());
+        ForEach([&](const T& item) {
+            result->Append(item);
+        });
+        return result;
     }
+};
 
-    T GetLast() override {
-        return list->GetLast();
-    }
+enum class AdaptiveRepresentation {
+    Array,
+    List,
+    Segmented,
+    Ring
+};
 
-    T Get(int index) const override {
-        return list->Get(index);
+inline const char* GetRepresentationName(AdaptiveRepresentation representation) {
+    switch (representation) {
+    case AdaptiveRepresentation::Array: return "Array";
+    case AdaptiveRepresentation::List: return "List";
+    case AdaptiveRepresentation::Segmented: return "Segmented";
+    case AdaptiveRepresentation::Ring: return "Ring";
     }
+    return "Unknown";
+}
 
-    int GetSize() const override {
-        return list->GetSize();
+// Operation mix observed by AdaptiveSequence, halved after every review so
+// that it follows the recent workload.
+struct AdaptiveWorkload {
+    double reads;
+    double frontInserts;
+    double middleInserts;
+    double backInserts;
+
+    AdaptiveWorkload() : reads(0), frontInserts(0), middleInserts(0), backInserts(0) {}
+
+    void Decay() {
+        reads /= 2;
+        frontInserts /= 2;
+        middleInserts /= 2;
+        backInserts /= 2;
     }
+};
 
-    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
-        if (startIndex < 0 || endIndex >= GetSize() || startIndex > endIndex)
-            throw IndexOutOfRange();
+const int AdaptiveSequenceWindow = 64;
+const int AdaptiveMigrationStep = 32;
+const double AdaptiveSequenceHysteresis = 1.5;
 
-        ListSequence<T>* subSequence = new ListSequence<T>();
-        for (int i = startIndex; i <= endIndex; ++i) {
-            subSequence->Append(Get(i));
+template <class T>
+class AdaptiveSequence final : public Sequence<T> {
+private:
+    Sequence<T>* sequence;
+    AdaptiveRepresentation representation;
+    const char* reason;
+    AdaptiveWorkload workload;
+    int operationsSinceReview;
+    // Reads through the const interface may come from several threads at
+    // once, so they only bump this and are folded into workload later.
+    mutable atomic<int> pendingReads;
+
+    // While migrating, the logical sequence is sequence followed by the
+    // elements of previous from position migrated on.
+    Sequence<T>* previous;
+    AdaptiveRepresentation previousRepresentation;
+    int migrated;
+    typename LinkedList<T>::Cursor previousCursor;
+
+    unique_ptr<SequenceIndex<T>> hashIndex;
+
+    // Applies a pending write through operator[] to the index.
+    void SettleIndex() const {
+        if (hashIndex) {
+            hashIndex->Settle([this](int position) {
+                return ItemAt(position);
+            });
         }
-        return subSequence;
     }
 
-    void Append(T item) override {
-        list->Append(item);
+    void CountRead() const {
+        pendingReads.fetch_add(1, memory_order_relaxed);
     }
 
-    void Prepend(T item) override {
-        list->Prepend(item);
+    void CollectReads() {
+        int reads = pendingReads.exchange(0, memory_order_relaxed);
+        workload.reads += reads;
+        operationsSinceReview += reads;
     }
 
-    void Insert(T item, int index) override {
-        list->Insert(item, index);
+    void CountInsert(int index, int size) {
+        CollectReads();
+        if (index == size) {
+            workload.backInserts += 1;
+        }
+        else if (index == 0) {
+            workload.frontInserts += 1;
+        }
+        else {
+            workload.middleInserts += 1;
+        }
+        operationsSinceReview++;
+        ReviewIfDue();
     }
 
-    Sequence<T>* Concat(Sequence<T>* other) override {
-        ListSequence<T>* newSequence = new ListSequence<T>(*this);
-        for (int i = 0; i < other->GetSize(); ++i) {
-            newSequence->Append(other->Get(i));
-        }
-        return newSequence;
+    // Reads through the non-const interface can review too, so that a
+    // read-only workload still leaves a representation with slow indexing.
+    void CountReadAndReview() {
+        CountRead();
+        CollectReads();
+        ReviewIfDue();
     }
 
-    Sequence<T>* Map(function<T(T)> func) override {
-        ListSequence<T>* newSequence = new ListSequence<T>();
-        for (int i = 0; i < GetSize(); ++i) {
-            newSequence->Append(func(Get(i)));
+    void ReviewIfDue() {
+        if (operationsSinceReview >= AdaptiveSequenceWindow && previous == nullptr) {
+            ReviewRepresentation();
         }
-        return newSequence;
     }
 
-    Sequence<T>* From(const Sequence<T>& other) override {
-        Sequence<T>* result = new ListSequence<T>();
-        for (int i = 0; i < other.GetSize(); ++i) {
-            result->Append(other.Get(i));
+    int PendingCount() const {
+        return previous != nullptr ? previous->GetSize() - migrated : 0;
+    }
+
+    // Relative cost of the observed mix; element moves get dearer with
+    // sizeof(T), node hops do not.
+    static double EstimateCost(AdaptiveRepresentation target, const AdaptiveWorkload& mix, int size) {
+        double move = max(1.0, static_cast<double>(sizeof(T)) / sizeof(void*)) / 4;
+        double n = size;
+        double segmentSize = min(SequenceTuning<T>::GetSegmentSize(), SegmentedList<T>::GetSegmentCapacity());
+        double segments = n / segmentSize;
+        switch (target) {
+        case AdaptiveRepresentation::Array:
+            return mix.reads + mix.frontInserts * n * move + mix.middleInserts * n / 2 * move + mix.backInserts;
+        case AdaptiveRepresentation::List:
+            return mix.reads * n / 2 + mix.frontInserts * 2 + mix.middleInserts * (n / 2 + 2) + mix.backInserts * 2;
+        case AdaptiveRepresentation::Segmented:
+            return mix.reads * segments + mix.frontInserts * segmentSize * move
+                + mix.middleInserts * (segments + segmentSize / 2 * move) + mix.backInserts * 2;
+        case AdaptiveRepresentation::Ring:
+            return mix.reads * 2 + mix.frontInserts * 2 + mix.middleInserts * n / 4 * move + mix.backInserts * 2;
         }
-        return result;
+        return 0;
     }
 
-    Sequence<T>* Zip(const Sequence<T>& other) const override {
-        ListSequence<T>* result = new ListSequence<T>();
-        int minSize = min(this->GetSize(), other.GetSize());
-        for (int i = 0; i < minSize; ++i) {
-            result->Append(this->Get(i));
-            result->Append(other.Get(i));
-        }
-        return result;
+    const char* DominantOperation() const {
+        double top = max(max(workload.reads, workload.frontInserts), max(workload.middleInserts, workload.backInserts));
+        if (top == workload.reads) return "index reads dominate";
+        if (top == workload.middleInserts) return "middle inserts dominate";
+        if (top == workload.frontInserts) return "front inserts dominate";
+        return "back inserts dominate";
     }
-    
-    bool TryGet(int index, T& value) override {
-        if (index < 0 || index >= GetSize()) {
-            return false;
+
+    static Sequence<T>* Create(AdaptiveRepresentation target) {
+        switch (target) {
+        case AdaptiveRepresentation::List: return new ListSequence<T>();
+        case AdaptiveRepresentation::Segmented: return new SegmentedList<T>();
+        case AdaptiveRepresentation::Ring: return new RingSequence<T>();
+        default: return new ArraySequence<T>();
         }
-        value = Get(index);
-        return true;
     }
 
-    bool TryFind(std::function<bool(T)> predicate, T& value) override {
-        for (int i = 0; i < GetSize(); ++i) {
-            if (predicate(Get(i))) {
-                value = Get(i);
-                return true;
+    template <class Func>
+    void ForEachItem(Func func) const {
+        switch (representation) {
+        case AdaptiveRepresentation::List:
+            static_cast<ListSequence<T>*>(sequence)->ForEach(func);
+            break;
+        case AdaptiveRepresentation::Segmented:
+            static_cast<SegmentedList<T>*>(sequence)->ForEach(func);
+            break;
+        case AdaptiveRepresentation::Ring:
+            static_cast<RingSequence<T>*>(sequence)->ForEach(func);
+            break;
+        default:
+            static_cast<ArraySequence<T>*>(sequence)->ForEach(func);
+            break;
+        }
+        if (previous == nullptr) {
+            return;
+        }
+        if (previousRepresentation == AdaptiveRepresentation::List) {
+            for (typename LinkedList<T>::Cursor cursor = previousCursor; cursor.IsValid(); cursor.Next()) {
+                func(cursor.Value());
+            }
+        }
+        else {
+            for (int i = migrated; i < migrated + PendingCount(); ++i) {
+                func(previous->Get(i));
             }
         }
-        return false;
     }
 
-    T& operator[](int index) override {
-        return (*list)[index];
+    T ItemAt(int index) const {
+        int head = sequence->GetSize();
+        if (index < head || previous == nullptr) {
+            return sequence->Get(index);
+        }
+        if (index - head >= PendingCount()) {
+            throw IndexOutOfRange();
+        }
+        if (index == head && previousRepresentation == AdaptiveRepresentation::List) {
+            return previousCursor.Value();
+        }
+        return previous->Get(migrated + index - head);
     }
 
-    const T& operator[](int index) const override {
-        return (*list)[index];
+    T& ItemRef(int index) {
+        int head = sequence->GetSize();
+        if (index < head || previous == nullptr) {
+            return (*sequence)[index];
+        }
+        if (index - head >= PendingCount()) {
+            throw IndexOutOfRange();
+        }
+        return WritablePrevious()[migrated + index - head];
+    }
+
+    // A write into a shared List previous unshares it, which moves its
+    // nodes, so the migration cursor is found again in the new copy.
+    Sequence<T>& WritablePrevious() {
+        if (previousRepresentation == AdaptiveRepresentation::List) {
+            ListSequence<T>* list = static_cast<ListSequence<T>*>(previous);
+            if (list->IsShared()) {
+                previousCursor = list->Begin();
+                for (int i = 0; i < migrated; ++i) {
+                    previousCursor.Next();
+                }
+            }
+        }
+        return *previous;
     }
 
-    Sequence<T>* Instance() override {
-        return this;
+    T TakePending() {
+        migrated++;
+        if (previousRepresentation == AdaptiveRepresentation::List) {
+            T item = previousCursor.Value();
+            previousCursor.Next();
+            return item;
+        }
+        return previous->Get(migrated - 1);
     }
 
-    Sequence<T>* Clone() const override {
-        return new ListSequence<T>(*this);
+    // Starts a migration; elements move over in AdaptiveMigrationStep
+    // batches on the following operations instead of all at once.
+    void SwitchTo(AdaptiveRepresentation target) {
+        previous = sequence;
+        previousRepresentation = representation;
+        migrated = 0;
+        if (previousRepresentation == AdaptiveRepresentation::List) {
+            previousCursor = static_cast<const ListSequence<T>*>(previous)->Begin();
+        }
+        sequence = Create(target);
+        representation = target;
     }
-};
 
-template <class T>
-class MutableListSequence : public ListSequence<T> {
 public:
-    using ListSequence<T>::ListSequence;
-    MutableListSequence() : ListSequence<T>() {}
+    AdaptiveSequence()
+        : representation(AdaptiveRepresentation::Array), reason("initial representation"), operationsSinceReview(0),
+          pendingReads(0), previous(nullptr), previousRepresentation(AdaptiveRepresentation::Array), migrated(0) {
+        sequence = new ArraySequence<T>();
+    }
 
-    MutableListSequence(T* items, int count) : ListSequence<T>(items, count) {}
+    AdaptiveSequence(T* items, int count)
+        : representation(AdaptiveRepresentation::Array), reason("initial representation"), operationsSinceReview(0),
+          pendingReads(0), previous(nullptr), previousRepresentation(AdaptiveRepresentation::Array), migrated(0) {
+        sequence = new ArraySequence<T>(items, count);
+    }
 
-    MutableListSequence(const MutableListSequence<T>& other) : ListSequence<T>(other) {}
+    // A copy taken mid-migration gets the target representation filled in
+    // full, since the migration cursor cannot be shared between copies.
+    AdaptiveSequence(const AdaptiveSequence<T>& other)
+        : representation(other.representation), reason(other.reason),
+          workload(other.GetWorkload()),
+          operationsSinceReview(other.operationsSinceReview + other.pendingReads.load(memory_order_relaxed)),
+          pendingReads(0), previous(nullptr), previousRepresentation(other.representation), migrated(0),
+          hashIndex(other.hashIndex ? other.hashIndex->Clone() : nullptr) {
+        if (other.previous == nullptr) {
+            sequence = other.sequence->Clone();
+            return;
+        }
+        sequence = Create(representation);
+        other.ForEachItem([this](const T& item) {
+            sequence->Append(item);
+        });
+    }
 
-    MutableListSequence(const Sequence<T>& other) : ListSequence<T>(other) {}
+    ~AdaptiveSequence() {
+        delete sequence;
+        delete previous;
+    }
 
-    Sequence<T>* Instance() override {
-        return this;
+    bool IsMigrating() const {
+        return previous != nullptr;
     }
 
-    Sequence<T>* Clone() const override {
-        return new MutableListSequence<T>(*this);
+    // Moves up to count pending elements into the current representation.
+    // Called on every operation; can also be called from idle time.
+    void AdvanceMigration(int count) {
+        if (previous == nullptr) {
+            return;
+        }
+        for (int i = 0; i < count && PendingCount() > 0; ++i) {
+            sequence->Append(TakePending());
+        }
+        if (PendingCount() == 0) {
+            delete previous;
+            previous = nullptr;
+            previousRepresentation = representation;
+            previousCursor = typename LinkedList<T>::Cursor();
+            migrated = 0;
+        }
     }
-};
 
-template <class T>
-class ImmutableListSequence : public ListSequence<T> {
-public:
-    using ListSequence<T>::ListSequence;
+    void FinishMigration() {
+        AdvanceMigration(PendingCount());
+    }
 
-    ImmutableListSequence(const ImmutableListSequence<T>& other) : ListSequence<T>(other) {}
+    // See ArraySequence::AttachIndex. Positions are logical, so the index
+    // is unaffected by representation switches.
+    void AttachIndex() {
+        if (!hashIndex) {
+            hashIndex.reset(new HashIndex<T>());
+        }
+    }
 
-    Sequence<T>* Instance() override {
-        return this->Clone();
+    void DetachIndex() {
+        hashIndex.reset();
     }
 
-    Sequence<T>* Clone() const override {
-        return new ImmutableListSequence<T>(*this);
+    bool HasIndex() const {
+        return hashIndex != nullptr;
     }
-};
 
-template <class T>
-class AdaptiveSequence : public Sequence<T> {
-private:
-    Sequence<T>* sequence;
+    // Not safe for concurrent callers while an index is attached; see
+    // ArraySequence::IndexOf.
+    int IndexOf(const T& value) const {
+        if (hashIndex) {
+            SettleIndex();
+            hashIndex->Refresh([this](auto func) {
+                ForEachItem(func);
+            });
+            return hashIndex->Find(value);
+        }
+        int index = 0;
+        int found = -1;
+        ForEachItem([&](const T& item) {
+            if (found == -1 && item == value) {
+                found = index;
+            }
+            index++;
+        });
+        return found;
+    }
 
-    void SwitchToList() {
-        Sequence<T>* newList = new ListSequence<T>();
-        for (int i = 0; i < sequence->GetSize(); ++i)
-            newList->Append(sequence->Get(i));
-        delete sequence;
-        sequence = newList;
+    bool Contains(const T& value) const {
+        return IndexOf(value) != -1;
     }
 
-    void SwitchToArray() {
-        Sequence<T>* newArray = new ArraySequence<T>();
-        for (int i = 0; i < sequence->GetSize(); ++i)
-            newArray->Append(sequence->Get(i));
-        delete sequence;
-        sequence = newArray;
+    void Set(int index, T value) {
+        SettleIndex();
+        AdvanceMigration(AdaptiveMigrationStep);
+        T& slot = ItemRef(index);
+        if (hashIndex) {
+            hashIndex->Replaced(slot, value, index);
+        }
+        slot = value;
     }
 
-public:
-    AdaptiveSequence() {
-        sequence = new ArraySequence<T>();
+    AdaptiveRepresentation GetRepresentation() const {
+        return representation;
     }
 
-    AdaptiveSequence(T* items, int count) {
-        sequence = new ArraySequence<T>(items, count);
+    const char* GetRepresentationReason() const {
+        return reason;
     }
 
-    AdaptiveSequence(const AdaptiveSequence<T>& other) {
-        sequence = other.sequence->Clone();
+    AdaptiveWorkload GetWorkload() const {
+        AdaptiveWorkload result = workload;
+        result.reads += pendingReads.load(memory_order_relaxed);
+        return result;
     }
 
-    ~AdaptiveSequence() {
-        delete sequence;
+    // Picks the cheapest representation for the recent operation mix. A
+    // switch needs a clear margin and must pay back the copy, so a mixed
+    // workload does not flip back and forth. Reads through the const
+    // interface are only counted; they are acted on at the next review,
+    // which the next non-const operation triggers once the window is full.
+    // A migration still running is finished first, so that its pending
+    // elements are not lost to the next switch.
+    void ReviewRepresentation() {
+        FinishMigration();
+        CollectReads();
+        operationsSinceReview = 0;
+        int size = GetSize();
+        AdaptiveRepresentation best = AdaptiveRepresentation::Array;
+        const char* bestReason = "size is within the adaptive switch size";
+        if (size > SequenceTuning<T>::GetAdaptiveSwitch()) {
+            const AdaptiveRepresentation candidates[] = {
+                AdaptiveRepresentation::Array, AdaptiveRepresentation::Ring,
+                AdaptiveRepresentation::Segmented, AdaptiveRepresentation::List
+            };
+            for (AdaptiveRepresentation candidate : candidates) {
+                if (EstimateCost(candidate, workload, size) < EstimateCost(best, workload, size)) {
+                    best = candidate;
+                }
+            }
+            bestReason = DominantOperation();
+        }
+
+        if (best == representation) {
+            reason = bestReason;
+        }
+        else {
+            double currentCost = EstimateCost(representation, workload, size);
+            double bestCost = EstimateCost(best, workload, size);
+            bool small = size <= SequenceTuning<T>::GetAdaptiveSwitch();
+            if (small || (bestCost * AdaptiveSequenceHysteresis < currentCost && currentCost - bestCost > size)) {
+                SwitchTo(best);
+                reason = bestReason;
+            }
+        }
+        workload.Decay();
     }
 
     T GetFirst() override {
-        return sequence->GetFirst();
+        CountReadAndReview();
+        AdvanceMigration(AdaptiveMigrationStep);
+        if (GetSize() == 0) throw IndexOutOfRange();
+        return ItemAt(0);
     }
 
     T GetLast() override {
-        return sequence->GetLast();
+        CountReadAndReview();
+        AdvanceMigration(AdaptiveMigrationStep);
+        return PendingCount() > 0 ? previous->GetLast() : sequence->GetLast();
     }
 
     T Get(int index) const override {
-        return sequence->Get(index);
+        CountRead();
+        return ItemAt(index);
     }
 
     int GetSize() const override {
-        return sequence->GetSize();
+        return sequence->GetSize() + PendingCount();
     }
 
     Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
-        return sequence->GetSubSequence(startIndex, endIndex);
+        if (previous == nullptr) {
+            return sequence->GetSubSequence(startIndex, endIndex);
+        }
+        if (startIndex < 0 || endIndex >= GetSize() || startIndex > endIndex) {
+            throw IndexOutOfRange();
+        }
+        Sequence<T>* subSequence = Create(representation);
+        for (int i = startIndex; i <= endIndex; ++i) {
+            subSequence->Append(ItemAt(i));
+        }
+        return subSequence;
     }
 
     void Append(T item) override {
-        if (dynamic_cast<ArraySequence<T>*>(sequence) && sequence->GetSize() > AdaptiveSequenceSwitch) {
-            SwitchToList();
+        CountInsert(GetSize(), GetSize());
+        AdvanceMigration(AdaptiveMigrationStep);
+        if (PendingCount() > 0) {
+            WritablePrevious().Append(item);
+        }
+        else {
+            sequence->Append(item);
+        }
+        if (hashIndex) {
+            hashIndex->Add(item, GetSize() - 1);
         }
-        sequence->Append(item);
     }
 
     void Prepend(T item) override {
-        if (dynamic_cast<ArraySequence<T>*>(sequence) && sequence->GetSize() > AdaptiveSequenceSwitch) {
-            SwitchToList();
-        }
+        SettleIndex();
+        CountInsert(0, GetSize());
+        AdvanceMigration(AdaptiveMigrationStep);
         sequence->Prepend(item);
+        if (hashIndex) {
+            hashIndex->AddFront(item);
+        }
     }
 
     void Insert(T item, int index) override {
-        if (dynamic_cast<ArraySequence<T>*>(sequence) && sequence->GetSize() > AdaptiveSequenceSwitch) {
-            SwitchToList();
+        if (index < 0 || index > GetSize()) {
+            throw IndexOutOfRange();
+        }
+        SettleIndex();
+        CountInsert(index, GetSize());
+        AdvanceMigration(AdaptiveMigrationStep);
+        int head = sequence->GetSize();
+        if (index <= head) {
+            sequence->Insert(item, index);
+        }
+        else {
+            WritablePrevious().Insert(item, migrated + index - head);
+        }
+        if (hashIndex) {
+            hashIndex->Inserted(item, index, GetSize());
         }
-        sequence->Insert(item, index);
     }
 
     Sequence<T>* Concat(Sequence<T>* other) override {
+        FinishMigration();
         return sequence->Concat(other);
     }
 
     Sequence<T>* Map(function<T(T)> func) override {
+        FinishMigration();
         return sequence->Map(func);
     }
 
@@ -799,19 +7207,41 @@ public:
     }
 
     bool TryGet(int index, T& value) override {
-        return sequence->TryGet(index, value);
+        if (index < 0 || index >= GetSize()) {
+            return false;
+        }
+        CountReadAndReview();
+        AdvanceMigration(AdaptiveMigrationStep);
+        value = ItemAt(index);
+        return true;
     }
 
     bool TryFind(function<bool(T)> predicate, T& value) override {
+        FinishMigration();
         return sequence->TryFind(predicate, value);
     }
 
     T& operator[](int index) override {
-        return (*sequence)[index];
+        CountReadAndReview();
+        AdvanceMigration(AdaptiveMigrationStep);
+        if (hashIndex) {
+            hashIndex->Writing(index, [this](int position) {
+                return ItemAt(position);
+            });
+        }
+        return ItemRef(index);
     }
 
     const T& operator[](int index) const override {
-        return (*sequence)[index];
+        CountRead();
+        int head = sequence->GetSize();
+        if (index < head || previous == nullptr) {
+            return (*sequence)[index];
+        }
+        if (index - head >= PendingCount()) {
+            throw IndexOutOfRange();
+        }
+        return (*static_cast<const Sequence<T>*>(previous))[migrated + index - head];
     }
 
     Sequence<T>* Instance() override {
@@ -821,238 +7251,637 @@ public:
     Sequence<T>* Clone() const override {
         return new AdaptiveSequence<T>(*this);
     }
+
+protected:
+    void SortItems(const typename Sequence<T>::Comparator& less, bool stable) override {
+        FinishMigration();
+        if (stable) {
+            sequence->StableSort(less);
+        }
+        else {
+            sequence->Sort(less);
+        }
+        if (hashIndex) {
+            hashIndex->Invalidate();
+        }
+    }
+
+    Sequence<T>* SelectTopK(int k, const typename Sequence<T>::Comparator& less) const override {
+        TopKCollector<T, typename Sequence<T>::Comparator> collector(k, less);
+        ForEachItem([&](const T& item) {
+            collector.Offer(item);
+        });
+        DynamicArray<T> items = collector.Take();
+        return new ArraySequence<T>(items.GetData(), items.GetSize());
+    }
+
+    void Visit(const function<void(const T&)>& visitor) const override {
+        ForEachItem(visitor);
+    }
 };
 
+// Lock acquisitions on one shard of a ConcurrentSequence; contended counts
+// the ones that had to wait for another thread.
+struct ConcurrentShardStats {
+    long long reads;
+    long long writes;
+    long long contended;
+
+    ConcurrentShardStats() : reads(0), writes(0), contended(0) {}
+};
+
+const int ConcurrentSequenceShards = 16;
+const int ConcurrentSequenceRangeShift = 6;
+
+// Whether writing one element of Base touches only that element, so Set
+// needs only the lock of the element's shard. Holds for unshared storage,
+// which ConcurrentSequence guarantees by never cloning its sequence.
+template <class Base>
+struct ConcurrentLocalWrites : false_type {};
+
+template <class T>
+struct ConcurrentLocalWrites<ArraySequence<T>> : true_type {};
+
 template <class T>
-class SegmentedList : public Sequence<T> {
+struct ConcurrentLocalWrites<RingSequence<T>> : true_type {};
+
+template <class T, class Checking, int SegmentBytes>
+struct ConcurrentLocalWrites<SegmentedList<T, Checking, SegmentBytes>> : true_type {};
+
+// Thread-safe wrapper for workloads with many readers and few writers.
+// Indices are grouped into ranges of 64 and the ranges hashed onto shards,
+// each with its own reader-writer lock, so readers of different ranges do
+// not share a lock. Set locks one shard; anything that shifts indices, and
+// any write into a Base without local writes (AdaptiveSequence may migrate
+// on a write), locks every shard in order.
+template <class T, class Base = SegmentedList<T>>
+class ConcurrentSequence {
 private:
-    static const size_t SEGMENT_SIZE = 32;
-    LinkedList<DynamicArray<T>*> segments;
+    struct Shard {
+        shared_timed_mutex lock;
+        atomic<long long> reads;
+        atomic<long long> writes;
+        atomic<long long> contended;
+        // Keeps neighbouring shards off each other's cache line without
+        // relying on over-aligned allocation.
+        char padding[64];
+
+        Shard() : reads(0), writes(0), contended(0) {}
+    };
 
-    pair<DynamicArray<T>*, int> GetSegment(int index) const {
-        if (index < 0 || index >= GetSize()) throw IndexOutOfRange();
+    Base sequence;
+    mutable Shard shards[ConcurrentSequenceShards];
+    atomic<int> size;
 
-        int currentPos = 0;
-        for (int i = 0; i < segments.GetSize(); i++) {
-            DynamicArray<T>* segment = segments.Get(i);
-            if (index < currentPos + segment->GetSize()) {
-                return { segment, index - currentPos };
-            }
-            currentPos += segment->GetSize();
+    static int ShardOf(int index) {
+        unsigned long long range = static_cast<unsigned>(index) >> ConcurrentSequenceRangeShift;
+        return static_cast<int>(((range * 0x9E3779B97F4A7C15ull) >> 32) % ConcurrentSequenceShards);
+    }
+
+    static void LockShared(Shard& shard) {
+        if (!shard.lock.try_lock_shared()) {
+            shard.contended.fetch_add(1, memory_order_relaxed);
+            shard.lock.lock_shared();
         }
-        throw IndexOutOfRange();
+        shard.reads.fetch_add(1, memory_order_relaxed);
     }
 
-    int GetSegmentIndex(int elementIndex) const {
-        int currentPos = 0;
-        for (int i = 0; i < segments.GetSize(); i++) {
-            currentPos += segments.Get(i)->GetSize();
-            if (elementIndex < currentPos) {
-                return i;
-            }
+    static void Lock(Shard& shard) {
+        if (!shard.lock.try_lock()) {
+            shard.contended.fetch_add(1, memory_order_relaxed);
+            shard.lock.lock();
         }
-        return segments.GetSize() - 1;
+        shard.writes.fetch_add(1, memory_order_relaxed);
     }
 
-    void SplitSegment(DynamicArray<T>* segment, int segmentIndex, int posInSegment) {
-        DynamicArray<T>* newSegment = new DynamicArray<T>();
-        int elementsToMove = segment->GetSize() - posInSegment;
+    class SharedGuard {
+    private:
+        Shard& shard;
+    public:
+        explicit SharedGuard(Shard& shard) : shard(shard) {
+            LockShared(shard);
+        }
+
+        ~SharedGuard() {
+            shard.lock.unlock_shared();
+        }
+    };
+
+    // Locks the flagged shards, always in ascending order so that two
+    // guards cannot deadlock.
+    class Guard {
+    private:
+        Shard* shards;
+        bool locked[ConcurrentSequenceShards];
+        bool exclusive;
+    public:
+        Guard(Shard* shards, const bool* wanted, bool exclusive) : shards(shards), exclusive(exclusive) {
+            for (int i = 0; i < ConcurrentSequenceShards; ++i) {
+                locked[i] = false;
+            }
+            for (int i = 0; i < ConcurrentSequenceShards; ++i) {
+                if (wanted == nullptr || wanted[i]) {
+                    if (exclusive) {
+                        Lock(shards[i]);
+                    }
+                    else {
+                        LockShared(shards[i]);
+                    }
+                    locked[i] = true;
+                }
+            }
+        }
 
-        for (int i = 0; i < elementsToMove; i++) {
-            newSegment->Append(segment->Get(posInSegment + i));
+        ~Guard() {
+            for (int i = ConcurrentSequenceShards - 1; i >= 0; --i) {
+                if (!locked[i]) {
+                    continue;
+                }
+                if (exclusive) {
+                    shards[i].lock.unlock();
+                }
+                else {
+                    shards[i].lock.unlock_shared();
+                }
+            }
         }
+    };
+
+    void CheckIndex(int index) const {
+        if (index < 0 || index >= size.load(memory_order_relaxed)) throw IndexOutOfRange();
+    }
 
-        segment->Resize(posInSegment);
-        segments.Insert(newSegment, segmentIndex + 1);
+    void Published() {
+        size.store(sequence.GetSize(), memory_order_release);
     }
 
 public:
+    // Writes collected here are applied by Apply under one acquisition of
+    // the locks they need: sets first, then appends.
+    class Batch {
+    private:
+        DynamicArray<int> indices;
+        DynamicArray<T> values;
+        DynamicArray<T> appended;
+
+        friend class ConcurrentSequence<T, Base>;
+    public:
+        void Set(int index, const T& value) {
+            indices.Append(index);
+            values.Append(value);
+        }
 
-    SegmentedList() = default;
+        void Append(const T& item) {
+            appended.Append(item);
+        }
 
-    SegmentedList(T* items, int count) {
-        for (int i = 0; i < count; i += SEGMENT_SIZE) {
-            int segmentSize = std::min(static_cast<int>(SEGMENT_SIZE), count - i);
-            DynamicArray<T>* segment = new DynamicArray<T>(segmentSize);
-            for (int j = 0; j < segmentSize; j++) {
-                (*segment)[j] = items[i + j];
-            }
-            segments.Append(segment);
+        int GetSize() const {
+            return indices.GetSize() + appended.GetSize();
         }
-    }
 
-    SegmentedList(const SegmentedList<T>& other) {
-        for (int i = 0; i < other.GetSize(); i++) {
-            this->Append(other.Get(i));
+        void Clear() {
+            indices = DynamicArray<int>();
+            values = DynamicArray<T>();
+            appended = DynamicArray<T>();
         }
+    };
+
+    ConcurrentSequence() : size(0) {}
+
+    // Copies items, so that no other sequence shares storage with this one.
+    explicit ConcurrentSequence(const Sequence<T>& items) : size(0) {
+        items.Visit([this](const T& item) {
+            sequence.Append(item);
+        });
+        Published();
     }
 
-    ~SegmentedList() {
-        for (int i = 0; i < segments.GetSize(); i++) {
-            delete segments.Get(i);
+    ConcurrentSequence(const ConcurrentSequence<T, Base>&) = delete;
+    ConcurrentSequence<T, Base>& operator=(const ConcurrentSequence<T, Base>&) = delete;
+
+    int GetSize() const {
+        return size.load(memory_order_acquire);
+    }
+
+    T Get(int index) const {
+        SharedGuard guard(shards[ShardOf(index)]);
+        CheckIndex(index);
+        return static_cast<const Base&>(sequence).Get(index);
+    }
+
+    bool TryGet(int index, T& value) const {
+        SharedGuard guard(shards[ShardOf(index)]);
+        if (index < 0 || index >= size.load(memory_order_relaxed)) {
+            return false;
         }
+        value = static_cast<const Base&>(sequence).Get(index);
+        return true;
     }
 
-    T GetFirst() override {
-        if (segments.GetSize() == 0) throw IndexOutOfRange();
-        DynamicArray<T>* firstSegment = segments.Get(0);
-        if (firstSegment->GetSize() == 0) throw IndexOutOfRange();
-        return (*firstSegment)[0];
+    void Set(int index, const T& value) {
+        bool wanted[ConcurrentSequenceShards] = {};
+        wanted[ShardOf(index)] = true;
+        Guard guard(shards, ConcurrentLocalWrites<Base>::value ? wanted : nullptr, true);
+        CheckIndex(index);
+        sequence[index] = value;
     }
 
-    T GetLast() override {
-        if (segments.GetSize() == 0) throw IndexOutOfRange();
-        DynamicArray<T>* lastSegment = segments.Get(segments.GetSize() - 1);
-        if (lastSegment->GetSize() == 0) throw IndexOutOfRange();
-        return (*lastSegment)[lastSegment->GetSize() - 1];
+    void Append(const T& item) {
+        Guard guard(shards, nullptr, true);
+        sequence.Append(item);
+        Published();
     }
 
-    T Get(int index) const override {
-        auto segmentInfo = GetSegment(index);
-        return segmentInfo.first->Get(segmentInfo.second);
+    void Prepend(const T& item) {
+        Guard guard(shards, nullptr, true);
+        sequence.Prepend(item);
+        Published();
     }
 
-    int GetSize() const override {
-        int size = 0;
-        for (int i = 0; i < segments.GetSize(); i++) {
-            size += segments.Get(i)->GetSize();
-        }
-        return size;
+    void Insert(const T& item, int index) {
+        Guard guard(shards, nullptr, true);
+        sequence.Insert(item, index);
+        Published();
     }
 
-    void Append(T item) override {
-        if (segments.GetSize() == 0 || segments.GetLast()->GetSize() >= SEGMENT_SIZE) {
-            segments.Append(new DynamicArray<T>());
+    // Applies every write in batch or, if an index is out of range, none.
+    void Apply(const Batch& batch) {
+        bool wanted[ConcurrentSequenceShards] = {};
+        bool all = batch.appended.GetSize() > 0 || !ConcurrentLocalWrites<Base>::value;
+        for (int i = 0; i < batch.indices.GetSize() && !all; ++i) {
+            wanted[ShardOf(batch.indices.AtUnchecked(i))] = true;
+        }
+        Guard guard(shards, all ? nullptr : wanted, true);
+        for (int i = 0; i < batch.indices.GetSize(); ++i) {
+            CheckIndex(batch.indices.AtUnchecked(i));
         }
-        segments.GetLast()->Append(item);
+        for (int i = 0; i < batch.indices.GetSize(); ++i) {
+            sequence[batch.indices.AtUnchecked(i)] = batch.values.AtUnchecked(i);
+        }
+        for (int i = 0; i < batch.appended.GetSize(); ++i) {
+            sequence.Append(batch.appended.AtUnchecked(i));
+        }
+        Published();
     }
 
-    void Prepend(T item) override {
-        if (segments.GetSize() == 0 || segments.GetFirst()->GetSize() >= SEGMENT_SIZE) {
-            segments.Prepend(new DynamicArray<T>());
+    // Visits a consistent state: writers wait until the walk is done.
+    void ForEach(const function<void(const T&)>& func) const {
+        Guard guard(shards, nullptr, false);
+        static_cast<const Sequence<T>&>(sequence).Visit(func);
+    }
+
+    // Copies the current elements into an ordinary sequence.
+    Sequence<T>* Snapshot() const {
+        Base* result = new Base();
+        ForEach([result](const T& item) {
+            result->Append(item);
+        });
+        return result;
+    }
+
+    int GetShardCount() const {
+        return ConcurrentSequenceShards;
+    }
+
+    ConcurrentShardStats GetShardStats(int shard) const {
+        if (shard < 0 || shard >= ConcurrentSequenceShards) throw IndexOutOfRange();
+        ConcurrentShardStats stats;
+        stats.reads = shards[shard].reads.load(memory_order_relaxed);
+        stats.writes = shards[shard].writes.load(memory_order_relaxed);
+        stats.contended = shards[shard].contended.load(memory_order_relaxed);
+        return stats;
+    }
+
+    // The shard whose lock had to wait most often.
+    int GetHottestShard() const {
+        int hottest = 0;
+        for (int i = 1; i < ConcurrentSequenceShards; ++i) {
+            if (shards[i].contended.load(memory_order_relaxed) > shards[hottest].contended.load(memory_order_relaxed)) {
+                hottest = i;
+            }
         }
-        segments.GetFirst()->Prepend(item);
+        return hottest;
     }
 
-    void Insert(T item, int index) override {
-        if (index < 0 || index > GetSize()) {
-            throw IndexOutOfRange();
+    void ResetShardStats() {
+        for (int i = 0; i < ConcurrentSequenceShards; ++i) {
+            shards[i].reads.store(0, memory_order_relaxed);
+            shards[i].writes.store(0, memory_order_relaxed);
+            shards[i].contended.store(0, memory_order_relaxed);
         }
+    }
+};
 
-        if (index == 0) {
-            Prepend(item);
-            return;
+
+// Measures the crossover points for T on this machine and stores them in
+// SequenceTuning<T>. Runs for a few tens of milliseconds.
+template <class T>
+void CalibrateSequenceTuning() {
+    typedef chrono::steady_clock Clock;
+    const int operations = 256;
+    const int repeats = 3;
+
+    // Adaptive switch: the smallest size at which front inserts into an
+    // array cost more than into a ring buffer.
+    int adaptiveSwitch = 1 << 16;
+    for (int size = 16; size < (1 << 16); size *= 2) {
+        Clock::duration arrayTime = Clock::duration::max();
+        Clock::duration ringTime = Clock::duration::max();
+        for (int repeat = 0; repeat < repeats; ++repeat) {
+            DynamicArray<T> array(size);
+            RingSequence<T> ring;
+            for (int i = 0; i < size; ++i) {
+                ring.Append(T());
+            }
+            Clock::time_point start = Clock::now();
+            for (int i = 0; i < operations; ++i) {
+                array.Prepend(T());
+            }
+            arrayTime = min(arrayTime, Clock::now() - start);
+            start = Clock::now();
+            for (int i = 0; i < operations; ++i) {
+                ring.Prepend(T());
+            }
+            ringTime = min(ringTime, Clock::now() - start);
         }
-        if (index == GetSize()) {
-            Append(item);
-            return;
+        if (arrayTime > ringTime) {
+            adaptiveSwitch = size;
+            break;
+        }
+    }
+    SequenceTuning<T>::SetAdaptiveSwitch(adaptiveSwitch);
+
+    // Segment size: the fastest candidate for a mix of random reads and
+    // middle inserts on a list a few times larger than L1.
+    int count = max(4096, 4 * GetL1DataCacheSize() / static_cast<int>(sizeof(T)));
+    int bestSize = SequenceTuning<T>::GetSegmentSize();
+    Clock::duration bestTime = Clock::duration::max();
+    for (int segmentSize = 16; segmentSize <= SegmentedList<T>::GetSegmentCapacity(); segmentSize *= 2) {
+        SequenceTuning<T>::SetSegmentSize(segmentSize);
+        SegmentedList<T> list;
+        for (int i = 0; i < count; ++i) {
+            list.Append(T());
+        }
+        unsigned int seed = 12345;
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < operations; ++i) {
+            seed = seed * 1103515245 + 12345;
+            int position = static_cast<int>(seed % static_cast<unsigned int>(list.GetSize()));
+            if (i % 2 == 0) {
+                list.Insert(T(), position);
+            }
+            else {
+                list.Get(position);
+            }
+        }
+        Clock::duration elapsed = Clock::now() - start;
+        if (elapsed < bestTime) {
+            bestTime = elapsed;
+            bestSize = segmentSize;
         }
+    }
+    SequenceTuning<T>::SetSegmentSize(bestSize);
+}
 
-        auto segmentInfo = GetSegment(index);
-        DynamicArray<T>* segment = segmentInfo.first;
-        int posInSegment = segmentInfo.second;
+// Loads the tuning for T from path, or calibrates and stores it there.
+template <class T>
+void InitSequenceTuning(const char* path) {
+    if (!SequenceTuning<T>::Load(path)) {
+        CalibrateSequenceTuning<T>();
+        SequenceTuning<T>::Save(path);
+    }
+}
 
-        if (segment->GetSize() < SEGMENT_SIZE) {
-            segment->Insert(item, posInSegment);
-            return;
-        }
+// Static (CRTP) counterpart of Sequence<T>: calls resolve at compile time,
+// so templated algorithms inline element access on the concrete container.
+template <class Derived, class T>
+class StaticSequence {
+protected:
+    Derived& Self() {
+        return static_cast<Derived&>(*this);
+    }
 
-        DynamicArray<T>* newSegment = new DynamicArray<T>();
-        int splitPos = SEGMENT_SIZE / 2;
+    const Derived& Self() const {
+        return static_cast<const Derived&>(*this);
+    }
 
-        for (int i = splitPos; i < segment->GetSize(); ++i) {
-            newSegment->Append(segment->Get(i));
-        }
+public:
+    T GetFirst() const {
+        if (Self().GetSize() == 0) throw IndexOutOfRange();
+        return Self().Get(0);
+    }
 
-        segment->Resize(splitPos);
-        int segmentIndex = GetSegmentIndex(index);
-        segments.Insert(newSegment, segmentIndex + 1);
+    T GetLast() const {
+        if (Self().GetSize() == 0) throw IndexOutOfRange();
+        return Self().Get(Self().GetSize() - 1);
+    }
 
-        if (posInSegment >= splitPos) {
-            newSegment->Insert(item, posInSegment - splitPos);
-        }
-        else {
-            segment->Insert(item, posInSegment);
+    bool TryGet(int index, T& value) const {
+        if (index < 0 || index >= Self().GetSize()) {
+            return false;
         }
+        value = Self().Get(index);
+        return true;
     }
 
-    Sequence<T>* GetSubSequence(int startIndex, int endIndex) override {
-        SegmentedList<T>* subList = new SegmentedList<T>();
-        for (int i = startIndex; i <= endIndex; i++) {
-            subList->Append(this->Get(i));
-        }
-        return subList;
+    template <class Predicate>
+    bool TryFind(Predicate predicate, T& value) const {
+        bool found = false;
+        Self().ForEachWhile([&](const T& item) {
+            if (predicate(item)) {
+                value = item;
+                found = true;
+            }
+            return !found;
+        });
+        return found;
     }
 
-    Sequence<T>* Concat(Sequence<T>* other) override {
-        SegmentedList<T>* result = new SegmentedList<T>(*this);
-        for (int i = 0; i < other->GetSize(); i++) {
-            result->Append(other->Get(i));
-        }
+    template <class Func>
+    Derived Map(Func func) const {
+        Derived result;
+        Self().ForEach([&](const T& item) {
+            result.Append(func(item));
+        });
         return result;
     }
 
-    Sequence<T>* Map(function<T(T)> func) override {
-        SegmentedList<T>* result = new SegmentedList<T>();
-        for (int i = 0; i < GetSize(); i++) {
-            result->Append(func(this->Get(i)));
+    template <class Acc, class Func>
+    Acc Reduce(Func func, Acc initial) const {
+        Self().ForEach([&](const T& item) {
+            initial = func(initial, item);
+        });
+        return initial;
+    }
+};
+
+template <class T>
+class StaticArraySequence final : public StaticSequence<StaticArraySequence<T>, T> {
+private:
+    DynamicArray<T> array;
+
+public:
+    StaticArraySequence() : array(0) {}
+
+    StaticArraySequence(T* items, int count) : array(items, count) {}
+
+    StaticArraySequence(const StaticArraySequence<T>& other) : array(other.array.GetSize()) {
+        for (int i = 0; i < other.GetSize(); ++i) {
+            array.AtUnchecked(i) = other.array.AtUnchecked(i);
         }
-        return result;
     }
 
-    Sequence<T>* From(const Sequence<T>& other) {
-        Sequence<T>* result = new SegmentedList<T>();
+    StaticArraySequence(const Sequence<T>& other) : array(other.GetSize()) {
         for (int i = 0; i < other.GetSize(); ++i) {
-            result->Append(other.Get(i));
+            array.AtUnchecked(i) = other.Get(i);
         }
-        return result;
     }
 
-    Sequence<T>* Zip(const Sequence<T>& other) const override {
-        SegmentedList<T>* result = new SegmentedList<T>();
-        int minSize = min(this->GetSize(), other.GetSize());
-        for (int i = 0; i < minSize; ++i) {
-            result->Append(this->Get(i));
-            result->Append(other.Get(i));
+    int GetSize() const {
+        return array.GetSize();
+    }
+
+    T Get(int index) const {
+        return array.Get(index);
+    }
+
+    T& operator[](int index) {
+        return array[index];
+    }
+
+    const T& operator[](int index) const {
+        return array[index];
+    }
+
+    void Append(T item) {
+        array.Append(item);
+    }
+
+    void Prepend(T item) {
+        array.Prepend(item);
+    }
+
+    void Insert(T item, int index) {
+        array.Insert(item, index);
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        for (int i = 0; i < array.GetSize(); ++i) {
+            func(array.AtUnchecked(i));
         }
-        return result;
     }
 
-    bool TryGet(int index, T& value) override {
-        if (index < 0 || index >= GetSize()) {
-            return false;
+    // Like ForEach, but stops as soon as func returns false.
+    template <class Func>
+    void ForEachWhile(Func func) const {
+        for (int i = 0; i < array.GetSize(); ++i) {
+            if (!func(array.AtUnchecked(i))) {
+                return;
+            }
         }
-        value = Get(index);
-        return true;
     }
 
-    bool TryFind(std::function<bool(T)> predicate, T& value) override {
-        for (int i = 0; i < GetSize(); i++) {
-            T item = Get(i);
-            if (predicate(item)) {
-                value = item;
-                return true;
+    template <class Less>
+    void Sort(const Less& less) {
+        SortBuffer(array.GetData(), array.GetSize(), less, false);
+    }
+
+    template <class Less>
+    void StableSort(const Less& less) {
+        SortBuffer(array.GetData(), array.GetSize(), less, true);
+    }
+
+    void Sort() {
+        Sort(std::less<T>());
+    }
+
+    void StableSort() {
+        StableSort(std::less<T>());
+    }
+};
+
+template <class T>
+class StaticListSequence final : public StaticSequence<StaticListSequence<T>, T> {
+private:
+    LinkedList<T> list;
+
+public:
+    StaticListSequence() = default;
+
+    StaticListSequence(T* items, int count) : list(items, count) {}
+
+    StaticListSequence(const StaticListSequence<T>& other) {
+        other.ForEach([this](const T& item) {
+            list.Append(item);
+        });
+    }
+
+    StaticListSequence(const Sequence<T>& other) {
+        for (int i = 0; i < other.GetSize(); ++i) {
+            list.Append(other.Get(i));
+        }
+    }
+
+    int GetSize() const {
+        return list.GetSize();
+    }
+
+    T Get(int index) const {
+        return list.Get(index);
+    }
+
+    T& operator[](int index) {
+        return list[index];
+    }
+
+    const T& operator[](int index) const {
+        return list[index];
+    }
+
+    void Append(T item) {
+        list.Append(item);
+    }
+
+    void Prepend(T item) {
+        list.Prepend(item);
+    }
+
+    void Insert(T item, int index) {
+        list.Insert(item, index);
+    }
+
+    template <class Func>
+    void ForEach(Func func) const {
+        list.ForEach(func);
+    }
+
+    // Like ForEach, but stops as soon as func returns false.
+    template <class Func>
+    void ForEachWhile(Func func) const {
+        for (typename LinkedList<T>::Cursor cursor = list.Begin(); cursor.IsValid(); cursor.Next()) {
+            if (!func(cursor.Value())) {
+                return;
             }
         }
-        return false;
     }
 
-    T& operator[](int index) override {
-        auto segmentInfo = GetSegment(index);
-        return (*segmentInfo.first)[segmentInfo.second];
+    template <class Less>
+    void Sort(const Less& less) {
+        list.Sort(less);
     }
 
-    const T& operator[](int index) const override {
-        auto segmentInfo = GetSegment(index);
-        return (*segmentInfo.first)[segmentInfo.second];
+    template <class Less>
+    void StableSort(const Less& less) {
+        list.Sort(less);
     }
 
-    Sequence<T>* Instance() override {
-        return this;
+    void Sort() {
+        Sort(std::less<T>());
     }
 
-    Sequence<T>* Clone() const override {
-        return new SegmentedList<T>(*this);
+    void StableSort() {
+        StableSort(std::less<T>());
     }
 };
 
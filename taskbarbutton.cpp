@@ -36,6 +36,7 @@ EVT_BUTTON(ID_TestButton, SequenceTesterFrame::OnTestButtonClick)
 END_EVENT_TABLE()
 
 bool SequenceTesterApp::OnInit() {
+    InitSequenceTuning<int>("sequences.cfg");
     SequenceTesterFrame* frame = new SequenceTesterFrame("Sequence Tester");
     frame->Show(true);
     return true;
@@ -61,6 +62,7 @@ SequenceTesterFrame::SequenceTesterFrame(const wxString& title)
     sequenceTypeChoice->Append("ImmutableArraySequence");
     sequenceTypeChoice->Append("MutableListSequence");
     sequenceTypeChoice->Append("ImmutableListSequence");
+    sequenceTypeChoice->Append("SortedArraySequence");
     sequenceTypeChoice->SetSelection(0);
 
     wxBoxSizer* typeSizer = new wxBoxSizer(wxHORIZONTAL);
@@ -99,26 +101,24 @@ void SequenceTesterFrame::OnTestButtonClick(wxCommandEvent& event) {
 
 void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
     // Parse input
-    wxArrayString inputItems = wxSplit(input, ',');
-    if (inputItems.IsEmpty()) {
+    DynamicArray<int> parsed(0);
+    string text = input.ToStdString();
+    string invalid;
+    if (!ParseNumbers<int>(text.data(), text.size(), parsed, &invalid)) {
+        wxMessageBox("Invalid number: " + wxString(invalid), "Error", wxOK | wxICON_ERROR);
+        return;
+    }
+    if (parsed.GetSize() == 0) {
         wxMessageBox("Please enter some numbers separated by commas", "Error", wxOK | wxICON_ERROR);
         return;
     }
 
-    int* items = new int[inputItems.GetCount()];
-    for (size_t i = 0; i < inputItems.GetCount(); i++) {
-        long value;
-        if (!inputItems[i].ToLong(&value)) {
-            wxMessageBox("Invalid number: " + inputItems[i], "Error", wxOK | wxICON_ERROR);
-            delete[] items;
-            return;
-        }
-        items[i] = (int)value;
-    }
+    int* items = parsed.GetData();
+    int count = parsed.GetSize();
 
     try {
         if (sequenceType == "DynamicArray") {
-            DynamicArray<int> arr(items, (int)inputItems.GetCount());
+            DynamicArray<int> arr(items, count);
 
             AddIntResult("Initial size", arr.GetSize());
             AddIntResult("Element at index 0", arr.Get(0));
@@ -158,7 +158,7 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             }
         }
         else if (sequenceType == "LinkedList") {
-            LinkedList<int> list(items, (int)inputItems.GetCount());
+            LinkedList<int> list(items, count);
 
             AddIntResult("Initial size", list.GetSize());
             AddIntResult("First element", list.GetFirst());
@@ -200,7 +200,7 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             }
         }
         else if (sequenceType == "ArraySequence") {
-            ArraySequence<int> seq(items, (int)inputItems.GetCount());
+            ArraySequence<int> seq(items, count);
 
             AddIntResult("Initial size", seq.GetSize());
             AddIntResult("First element", seq.GetFirst());
@@ -259,6 +259,11 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             AddIntResult("Zip size", zippedSeq->GetSize());
             delete zippedSeq;
 
+            // Test Sort
+            seq.Sort();
+            AddIntResult("Sort first element", seq.GetFirst());
+            AddIntResult("Sort last element", seq.GetLast());
+
             // Test exception
             try {
                 seq.Get(100);
@@ -268,7 +273,7 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             }
         }
         else if (sequenceType == "ListSequence") {
-            ListSequence<int> seq(items, (int)inputItems.GetCount());
+            ListSequence<int> seq(items, count);
 
             AddIntResult("Initial size", seq.GetSize());
             AddIntResult("First element", seq.GetFirst());
@@ -327,6 +332,11 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             AddIntResult("Zip size", zippedSeq->GetSize());
             delete zippedSeq;
 
+            // Test Sort
+            seq.Sort();
+            AddIntResult("Sort first element", seq.GetFirst());
+            AddIntResult("Sort last element", seq.GetLast());
+
             // Test exception
             try {
                 seq.Get(100);
@@ -336,7 +346,7 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             }
         }
         else if (sequenceType == "AdaptiveSequence") {
-            AdaptiveSequence<int> seq(items, (int)inputItems.GetCount());
+            AdaptiveSequence<int> seq(items, count);
 
             AddIntResult("Initial size", seq.GetSize());
             AddIntResult("First element", seq.GetFirst());
@@ -354,14 +364,23 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             AddIntResult("After Insert(99, 2) size", seq.GetSize());
             AddIntResult("Element at index 2", seq.Get(2));
 
-            // Force switch to list by adding many elements
-            if (seq.GetSize() < AdaptiveSequenceSwitch) {
-                for (int i = 0; i < AdaptiveSequenceSwitch; i++) {
-                    seq.Append(i);
+            // Grow past the switch size with front inserts so the policy can react
+            int adaptiveSwitch = SequenceTuning<int>::GetAdaptiveSwitch();
+            AddIntResult("Adaptive switch size", adaptiveSwitch);
+            if (seq.GetSize() < adaptiveSwitch) {
+                for (int i = 0; i < 2 * adaptiveSwitch; i++) {
+                    seq.Prepend(i);
                 }
-                AddIntResult("After force switch size", seq.GetSize());
-                AddResult("Switch check", "Should have switched to list");
+                int sizeBeforeReview = seq.GetSize();
+                int firstBeforeReview = seq.Get(0);
+                int lastBeforeReview = seq.Get(sizeBeforeReview - 1);
+                seq.ReviewRepresentation();
+                AddIntResult("After front inserts size", seq.GetSize());
+                AddBoolResult("Review kept size and contents", seq.GetSize() == sizeBeforeReview
+                    && seq.Get(0) == firstBeforeReview && seq.Get(sizeBeforeReview - 1) == lastBeforeReview);
             }
+            AddResult("Representation", GetRepresentationName(seq.GetRepresentation()));
+            AddResult("Representation reason", seq.GetRepresentationReason());
 
             Sequence<int>* subSeq = seq.GetSubSequence(1, 3);
             AddIntResult("SubSequence(1,3) size", subSeq->GetSize());
@@ -414,7 +433,7 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
         }
         else if (sequenceType == "SegmentedList") {
             SegmentedList<int> list;
-            for (size_t i = 0; i < inputItems.GetCount(); i++) {
+            for (int i = 0; i < count; i++) {
                 list.Append(items[i]);
             }
 
@@ -439,6 +458,9 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
                 list.Append(i);
             }
             AddIntResult("After multiple appends size", list.GetSize());
+            AddIntResult("Segment count", list.GetSegmentCount());
+            list.Compact();
+            AddIntResult("Segment count after Compact", list.GetSegmentCount());
 
             Sequence<int>* subSeq = list.GetSubSequence(1, 3);
             AddIntResult("SubSequence(1,3) size", subSeq->GetSize());
@@ -490,7 +512,7 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             }
         }
         else if (sequenceType == "MutableArraySequence") {
-            MutableArraySequence<int>* seq = new MutableArraySequence<int>(items, (int)inputItems.GetCount());
+            MutableArraySequence<int>* seq = new MutableArraySequence<int>(items, count);
 
             AddIntResult("Initial size", seq->GetSize());
             AddIntResult("First element", seq->GetFirst());
@@ -528,7 +550,7 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             delete seq;
         }
         else if (sequenceType == "ImmutableArraySequence") {
-            ImmutableArraySequence<int>* seq = new ImmutableArraySequence<int>(items, (int)inputItems.GetCount());
+            ImmutableArraySequence<int>* seq = new ImmutableArraySequence<int>(items, count);
 
             AddIntResult("Initial size", seq->GetSize());
             AddIntResult("First element", seq->GetFirst());
@@ -571,7 +593,7 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             delete seq;
         }
         else if (sequenceType == "MutableListSequence") {
-            MutableListSequence<int>* seq = new MutableListSequence<int>(items, (int)inputItems.GetCount());
+            MutableListSequence<int>* seq = new MutableListSequence<int>(items, count);
 
             AddIntResult("Initial size", seq->GetSize());
             AddIntResult("First element", seq->GetFirst());
@@ -609,7 +631,7 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             delete seq;
         }
         else if (sequenceType == "ImmutableListSequence") {
-            ImmutableListSequence<int>* seq = new ImmutableListSequence<int>(items, (int)inputItems.GetCount());
+            ImmutableListSequence<int>* seq = new ImmutableListSequence<int>(items, count);
 
             AddIntResult("Initial size", seq->GetSize());
             AddIntResult("First element", seq->GetFirst());
@@ -651,6 +673,23 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
             //  ...
             delete seq;
         }
+        else if (sequenceType == "SortedArraySequence") {
+            SortedArraySequence<int> seq(items, count);
+
+            AddIntResult("Initial size", seq.GetSize());
+            AddIntResult("First element", seq.GetFirst());
+            AddIntResult("Last element", seq.GetLast());
+
+            int position = seq.Insert(3);
+            AddIntResult("Insert(3) position", position);
+            AddIntResult("LowerBound(3)", seq.LowerBound(3));
+            AddIntResult("UpperBound(3)", seq.UpperBound(3));
+            AddBoolResult("Contains(3)", seq.Contains(3));
+            AddBoolResult("Contains(-1)", seq.Contains(-1));
+
+            seq.Append(0);
+            AddIntResult("After Append(0) first element", seq.GetFirst());
+        }
     }
     catch (const IndexOutOfRange& e) {
         AddResult("Error", e.what());
@@ -658,8 +697,6 @@ void SequenceTesterFrame::TestSequence(wxString sequenceType, wxString input) {
     catch (const std::exception& e) {
         AddResult("Error", e.what());
     }
-
-    delete[] items;
 }
 
 void SequenceTesterFrame::AddResult(wxString operation, wxString result) {